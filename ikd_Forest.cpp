@@ -0,0 +1,761 @@
+#include "ikd_Forest.h"
+
+/*
+Description: forest of ikd-Trees, one per map tile
+*/
+
+// Scratch buffers of the tile searches, reused by every search of the thread
+static thread_local Nearest_Search_Context tile_search_context;
+static thread_local PointType_Heap forest_search_heap;
+static thread_local PointVector tile_points;
+static thread_local vector<float> tile_dist;
+
+KD_FOREST::KD_FOREST(float tile_length, float delete_param, float balance_param, float box_length, int thread_number){
+    delete_criterion_param = delete_param;
+    balance_criterion_param = balance_param;
+    downsample_size = box_length;
+    // Tiles are a whole number of downsample boxes, so no box is split between two tiles
+    tile_size = max(1.0f, roundf(tile_length / box_length)) * box_length;
+    thread_num = thread_number;
+    if (thread_num <= 0) thread_num = sysconf(_SC_NPROCESSORS_ONLN);
+    thread_num = max(1, min(thread_num, Forest_Max_Thread_Num));
+    pthread_rwlockattr_t tiles_rwlock_attr;
+    pthread_rwlockattr_init(&tiles_rwlock_attr);
+#ifdef __GLIBC__
+    // Searches would otherwise starve the evictions of the loader thread
+    pthread_rwlockattr_setkind_np(&tiles_rwlock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&tiles_rwlock, &tiles_rwlock_attr);
+    pthread_rwlockattr_destroy(&tiles_rwlock_attr);
+    pthread_mutex_init(&paging_mutex, NULL);
+    pthread_mutex_init(&update_mutex, NULL);
+    pthread_cond_init(&load_signal, NULL);
+    pthread_cond_init(&loaded_signal, NULL);
+    pthread_cond_init(&evicted_signal, NULL);
+    pthread_mutex_init(&pool_mutex, NULL);
+    pthread_cond_init(&pool_signal, NULL);
+    pthread_cond_init(&pool_done_signal, NULL);
+    worker_num = thread_num - 1;
+    for (int i = 0; i < worker_num; i++) pthread_create(&workers[i], NULL, worker_thread_ptr, (void*) this);
+}
+
+KD_FOREST::~KD_FOREST(){
+    pthread_mutex_lock(&pool_mutex);
+    pool_termination = true;
+    pthread_cond_broadcast(&pool_signal);
+    pthread_mutex_unlock(&pool_mutex);
+    for (int i = 0; i < worker_num; i++) pthread_join(workers[i], NULL);
+    pthread_cond_destroy(&pool_signal);
+    pthread_cond_destroy(&pool_done_signal);
+    pthread_mutex_destroy(&pool_mutex);
+    // The loader thread is stopped first, it may evict tiles
+    if (loader_started){
+        pthread_mutex_lock(&paging_mutex);
+        loader_termination = true;
+        pthread_cond_signal(&load_signal);
+        pthread_mutex_unlock(&paging_mutex);
+        pthread_join(loader_thread, NULL);
+    }
+    Clear_Tiles();
+    pthread_mutex_destroy(&update_mutex);
+    pthread_cond_destroy(&load_signal);
+    pthread_cond_destroy(&loaded_signal);
+    pthread_cond_destroy(&evicted_signal);
+    pthread_mutex_destroy(&paging_mutex);
+    pthread_rwlock_destroy(&tiles_rwlock);
+}
+
+int KD_FOREST::size(){
+    int s = 0;
+    pthread_rwlock_rdlock(&tiles_rwlock);
+    for (auto & tile : tiles){
+        KD_TREE * tree = tile.second->tree;
+        s += (tree != nullptr) ? tree->size() : tile.second->disk_point_num;
+    }
+    pthread_rwlock_unlock(&tiles_rwlock);
+    return s;
+}
+
+int KD_FOREST::validnum(){
+    int s = 0;
+    pthread_rwlock_rdlock(&tiles_rwlock);
+    for (auto & tile : tiles){
+        KD_TREE * tree = tile.second->tree;
+        s += (tree != nullptr) ? tree->validnum() : tile.second->disk_point_num;
+    }
+    pthread_rwlock_unlock(&tiles_rwlock);
+    return s;
+}
+
+int KD_FOREST::resident_num(){
+    int s = 0;
+    pthread_rwlock_rdlock(&tiles_rwlock);
+    for (auto & tile : tiles){
+        KD_TREE * tree = tile.second->tree;
+        if (tree != nullptr) s += tree->size();
+    }
+    pthread_rwlock_unlock(&tiles_rwlock);
+    return s;
+}
+
+int KD_FOREST::tile_num(){
+    pthread_rwlock_rdlock(&tiles_rwlock);
+    int s = tiles.size();
+    pthread_rwlock_unlock(&tiles_rwlock);
+    return s;
+}
+
+void KD_FOREST::Build(PointVector point_cloud){
+    pthread_mutex_lock(&update_mutex);
+    Clear_Tiles();
+    Assign_Point_IDs(point_cloud);
+    if (max_resident_points <= 0){
+        Route_Points(point_cloud, FOREST_BUILD);
+        pthread_mutex_unlock(&update_mutex);
+        return;
+    }
+    // Grouped by tile and built whole tiles at a time, each chunk is paged out before the next one is built
+    sort(point_cloud.begin(), point_cloud.end(), [this](const PointType & a, const PointType & b){
+        return tile_key(tile_index(a.x), tile_index(a.y)) < tile_key(tile_index(b.x), tile_index(b.y));
+    });
+    PointVector chunk;
+    int chunk_begin = 0;
+    for (int i = 1; i <= int(point_cloud.size()); i++){
+        if (i < int(point_cloud.size())){
+            if (i - chunk_begin < max_resident_points) continue;
+            if (tile_index(point_cloud[i].x) == tile_index(point_cloud[i-1].x) && tile_index(point_cloud[i].y) == tile_index(point_cloud[i-1].y)) continue;
+        }
+        chunk.assign(point_cloud.begin() + chunk_begin, point_cloud.begin() + i);
+        Route_Points(chunk, FOREST_BUILD);
+        Evict_Tiles();
+        chunk_begin = i;
+    }
+    pthread_mutex_unlock(&update_mutex);
+    return;
+}
+
+void KD_FOREST::Assign_Point_IDs(PointVector & points){
+    // Numbered here rather than by the tile trees, so that ids are unique across tiles
+    for (int i = 0; i < points.size(); i++){
+        if (points[i].id == Invalid_Point_ID) points[i].id = point_id_num++;
+    }
+    return;
+}
+
+uint32_t KD_FOREST::next_point_id(){
+    return point_id_num;
+}
+
+void KD_FOREST::Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> & Point_Distance){
+    if (max_resident_points > 0 && resident_estimate > max_resident_points * (1.0f + Forest_Resident_Slack)) Wait_For_Eviction();
+    PointType_Heap & q = forest_search_heap;
+    q.clear();
+    pthread_rwlock_rdlock(&tiles_rwlock);
+    int center[2] = {tile_index(point.x), tile_index(point.y)};
+    int max_ring = -1;
+    if (!tiles.empty()){
+        for (int i = 0; i < 2; i++) max_ring = max(max_ring, max(center[i] - tile_min[i], tile_max[i] - center[i]));
+    }
+    // Visit the tiles ring by ring around the tile of the query
+    for (int ring = 0; ring <= max_ring; ring++){
+        if (ring > 0 && q.size() >= k_nearest){
+            // All tiles of this ring lie outside the square of the inner rings
+            float inner_dist = min(min(point.x - (center[0] - ring + 1) * tile_size, (center[0] + ring) * tile_size - point.x),
+                                   min(point.y - (center[1] - ring + 1) * tile_size, (center[1] + ring) * tile_size - point.y));
+            if (inner_dist * inner_dist >= q.top().dist) break;
+        }
+        int ix_min = max(center[0] - ring, tile_min[0]), ix_max = min(center[0] + ring, tile_max[0]);
+        int iy_min = max(center[1] - ring, tile_min[1]), iy_max = min(center[1] + ring, tile_max[1]);
+        for (int ix = ix_min; ix <= ix_max; ix++){
+            bool ring_column = (ix == center[0] - ring || ix == center[0] + ring);
+            for (int iy = iy_min; iy <= iy_max; iy++){
+                if (!ring_column && iy != center[1] - ring && iy != center[1] + ring) continue;
+                if (q.size() >= k_nearest && calc_tile_dist(point, ix, iy) >= q.top().dist) continue;
+                Search_Tile(ix, iy, point, k_nearest, q);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&tiles_rwlock);
+    int k_found = min(k_nearest, int(q.size()));
+    Nearest_Points.resize(k_found);
+    Point_Distance.resize(k_found);
+    for (int i = k_found - 1; i >= 0; i--){
+        Nearest_Points[i] = q.top().point;
+        Point_Distance[i] = q.top().dist;
+        q.pop();
+    }
+    return;
+}
+
+void KD_FOREST::Nearest_Search_Batch(PointVector & Query_Points, int k_nearest, vector<PointVector> & Nearest_Points, vector<vector<float>> & Point_Distance){
+    int query_num = Query_Points.size();
+    Nearest_Points.resize(query_num);
+    Point_Distance.resize(query_num);
+    Forest_Task_Context context;
+    context.op = FOREST_SEARCH;
+    context.k_nearest = k_nearest;
+    context.query_points = &Query_Points;
+    context.nearest_points = &Nearest_Points;
+    context.point_distance = &Point_Distance;
+    for (int i = 0; i < query_num; i += Forest_Search_Chunk){
+        Forest_Task_Type task;
+        task.query_begin = i;
+        task.query_end = min(query_num, i + Forest_Search_Chunk);
+        context.tasks.push_back(task);
+    }
+    Run_Tasks(context);
+    return;
+}
+
+void KD_FOREST::Add_Points(PointVector & PointToAdd, bool downsample_on){
+    pthread_mutex_lock(&update_mutex);
+    Assign_Point_IDs(PointToAdd);
+    Route_Points(PointToAdd, downsample_on ? FOREST_DOWNSAMPLE_ADD_POINTS : FOREST_ADD_POINTS);
+    Evict_Tiles();
+    pthread_mutex_unlock(&update_mutex);
+    return;
+}
+
+int KD_FOREST::Add_Point_Boxes(vector<BoxPointType> & BoxPoints, PointVector * Revived_Points){
+    pthread_mutex_lock(&update_mutex);
+    int revived_num = Route_Boxes(BoxPoints, FOREST_ADD_BOXES, Revived_Points);
+    Evict_Tiles();
+    pthread_mutex_unlock(&update_mutex);
+    return revived_num;
+}
+
+void KD_FOREST::Delete_Points(PointVector & PointToDel){
+    pthread_mutex_lock(&update_mutex);
+    Route_Points(PointToDel, FOREST_DELETE_POINTS);
+    Evict_Tiles();
+    pthread_mutex_unlock(&update_mutex);
+    return;
+}
+
+void KD_FOREST::Delete_Point_Boxes(vector<BoxPointType> & BoxPoints){
+    pthread_mutex_lock(&update_mutex);
+    Route_Boxes(BoxPoints, FOREST_DELETE_BOXES);
+    Evict_Tiles();
+    pthread_mutex_unlock(&update_mutex);
+    return;
+}
+
+int KD_FOREST::Add_Point_Regions(vector<RegionType> & Regions, PointVector * Revived_Points){
+    pthread_mutex_lock(&update_mutex);
+    int revived_num = Route_Regions(Regions, FOREST_ADD_REGIONS, Revived_Points);
+    Evict_Tiles();
+    pthread_mutex_unlock(&update_mutex);
+    return revived_num;
+}
+
+void KD_FOREST::Delete_Point_Regions(vector<RegionType> & Regions){
+    pthread_mutex_lock(&update_mutex);
+    Route_Regions(Regions, FOREST_DELETE_REGIONS);
+    Evict_Tiles();
+    pthread_mutex_unlock(&update_mutex);
+    return;
+}
+
+void KD_FOREST::acquire_removed_points(PointVector & removed_points){
+    pthread_mutex_lock(&paging_mutex);
+    if (removed_points.empty()){
+        removed_points.swap(Points_evicted);
+    } else {
+        removed_points.insert(removed_points.end(), Points_evicted.begin(), Points_evicted.end());
+        Points_evicted.clear();
+    }
+    pthread_mutex_unlock(&paging_mutex);
+    pthread_rwlock_rdlock(&tiles_rwlock);
+    for (auto & tile : tiles){
+        KD_TREE * tree = tile.second->tree;
+        if (tree == nullptr) continue;
+        tree->acquire_removed_points(removed_points);
+    }
+    pthread_rwlock_unlock(&tiles_rwlock);
+    return;
+}
+
+int64_t KD_FOREST::tile_key(int ix, int iy){
+    return (int64_t(ix) << 32) | uint32_t(iy);
+}
+
+int KD_FOREST::tile_index(float value){
+    return int(floorf(value / tile_size));
+}
+
+Forest_Tile_Type * KD_FOREST::Find_Tile(int ix, int iy){
+    auto tile = tiles.find(tile_key(ix, iy));
+    if (tile == tiles.end()) return nullptr;
+    return tile->second;
+}
+
+Forest_Tile_Type * KD_FOREST::Get_Tile(int ix, int iy){
+    Forest_Tile_Type * tile = Find_Tile(ix, iy);
+    if (tile != nullptr) return tile;
+    tile = new Forest_Tile_Type;
+    tile->ix = ix;
+    tile->iy = iy;
+    tile->tree = new KD_TREE(delete_criterion_param, balance_criterion_param, downsample_size);
+    pthread_rwlock_wrlock(&tiles_rwlock);
+    if (tiles.empty()){
+        tile_min[0] = tile_max[0] = ix;
+        tile_min[1] = tile_max[1] = iy;
+    }
+    tile_min[0] = min(tile_min[0], ix);
+    tile_max[0] = max(tile_max[0], ix);
+    tile_min[1] = min(tile_min[1], iy);
+    tile_max[1] = max(tile_max[1], iy);
+    tiles[tile_key(ix, iy)] = tile;
+    pthread_rwlock_unlock(&tiles_rwlock);
+    return tile;
+}
+
+void KD_FOREST::Clear_Tiles(){
+    char file_name[1024];
+    // Let the loads in flight finish, nothing queues new ones until the table is refilled
+    pthread_mutex_lock(&paging_mutex);
+    queue<Forest_Tile_Type *> ().swap(load_queue);
+    while (loading_num > 0) pthread_cond_wait(&loaded_signal, &paging_mutex);
+    pthread_mutex_unlock(&paging_mutex);
+    pthread_rwlock_wrlock(&tiles_rwlock);
+    for (auto & tile : tiles){
+        if (tile.second->tree != nullptr){
+            delete tile.second->tree.load();
+        } else {
+            tile_file_name(tile.second, file_name, sizeof(file_name));
+            remove(file_name);
+        }
+        delete tile.second;
+    }
+    tiles.clear();
+    resident_estimate = 0;
+    tile_min[0] = tile_min[1] = 0;
+    tile_max[0] = tile_max[1] = -1;
+    pthread_rwlock_unlock(&tiles_rwlock);
+    return;
+}
+
+void KD_FOREST::Route_Points(PointVector & points, forest_task_set op){
+    Forest_Task_Context context;
+    context.op = op;
+    unordered_map<int64_t, int> task_index;
+    for (int i = 0; i < points.size(); i++){
+        int ix = tile_index(points[i].x), iy = tile_index(points[i].y);
+        int64_t key = tile_key(ix, iy);
+        auto iter = task_index.find(key);
+        if (iter == task_index.end()){
+            Forest_Tile_Type * tile = (op == FOREST_DELETE_POINTS) ? Find_Tile(ix, iy) : Get_Tile(ix, iy);
+            if (tile == nullptr) continue;
+            iter = task_index.insert(make_pair(key, int(context.tasks.size()))).first;
+            context.tasks.push_back(Forest_Task_Type());
+            context.tasks.back().tile = tile;
+        }
+        context.tasks[iter->second].points.push_back(points[i]);
+    }
+    Run_Tasks(context);
+    return;
+}
+
+int KD_FOREST::Route_Boxes(vector<BoxPointType> & boxes, forest_task_set op, PointVector * Revived_Points){
+    Forest_Task_Context context;
+    context.op = op;
+    context.record_revived = (Revived_Points != nullptr);
+    unordered_map<int64_t, int> task_index;
+    for (int i = 0; i < boxes.size(); i++){
+        // A box is sent to every existing tile it overlaps
+        int ix_min = max(tile_index(boxes[i].vertex_min[0]), tile_min[0]), ix_max = min(tile_index(boxes[i].vertex_max[0]), tile_max[0]);
+        int iy_min = max(tile_index(boxes[i].vertex_min[1]), tile_min[1]), iy_max = min(tile_index(boxes[i].vertex_max[1]), tile_max[1]);
+        for (int ix = ix_min; ix <= ix_max; ix++){
+            for (int iy = iy_min; iy <= iy_max; iy++){
+                int64_t key = tile_key(ix, iy);
+                auto iter = task_index.find(key);
+                if (iter == task_index.end()){
+                    Forest_Tile_Type * tile = Find_Tile(ix, iy);
+                    if (tile == nullptr) continue;
+                    iter = task_index.insert(make_pair(key, int(context.tasks.size()))).first;
+                    context.tasks.push_back(Forest_Task_Type());
+                    context.tasks.back().tile = tile;
+                }
+                context.tasks[iter->second].boxes.push_back(boxes[i]);
+            }
+        }
+    }
+    Run_Tasks(context);
+    return Collect_Revived(context, Revived_Points);
+}
+
+int KD_FOREST::Route_Regions(vector<RegionType> & regions, forest_task_set op, PointVector * Revived_Points){
+    Forest_Task_Context context;
+    context.op = op;
+    context.record_revived = (Revived_Points != nullptr);
+    unordered_map<int64_t, int> task_index;
+    for (int i = 0; i < regions.size(); i++){
+        // A region is sent to every existing tile its bound overlaps, the bound is clamped first as it may be unbounded
+        float x_min = max(regions[i].bound.vertex_min[0], tile_min[0] * tile_size), x_max = min(regions[i].bound.vertex_max[0], (tile_max[0] + 1) * tile_size);
+        float y_min = max(regions[i].bound.vertex_min[1], tile_min[1] * tile_size), y_max = min(regions[i].bound.vertex_max[1], (tile_max[1] + 1) * tile_size);
+        int ix_min = max(tile_index(x_min), tile_min[0]), ix_max = min(tile_index(x_max), tile_max[0]);
+        int iy_min = max(tile_index(y_min), tile_min[1]), iy_max = min(tile_index(y_max), tile_max[1]);
+        for (int ix = ix_min; ix <= ix_max; ix++){
+            for (int iy = iy_min; iy <= iy_max; iy++){
+                int64_t key = tile_key(ix, iy);
+                auto iter = task_index.find(key);
+                if (iter == task_index.end()){
+                    Forest_Tile_Type * tile = Find_Tile(ix, iy);
+                    if (tile == nullptr) continue;
+                    iter = task_index.insert(make_pair(key, int(context.tasks.size()))).first;
+                    context.tasks.push_back(Forest_Task_Type());
+                    context.tasks.back().tile = tile;
+                }
+                context.tasks[iter->second].regions.push_back(regions[i]);
+            }
+        }
+    }
+    Run_Tasks(context);
+    return Collect_Revived(context, Revived_Points);
+}
+
+void KD_FOREST::Run_Tasks(Forest_Task_Context & context){
+    // The calling thread takes part, so a single task wakes no worker
+    int helper_num = min(thread_num, int(context.tasks.size())) - 1;
+    context.forest = this;
+    context.next_task = 0;
+    if (helper_num > 0){
+        pthread_mutex_lock(&pool_mutex);
+        context.open_worker_num = helper_num;
+        context.active_worker_num = 0;
+        pool_contexts.push_back(&context);
+        pthread_cond_broadcast(&pool_signal);
+        pthread_mutex_unlock(&pool_mutex);
+    }
+    Task_Loop(context);
+    if (helper_num > 0){
+        // No worker joins once the context is withdrawn, those already in finish their last task
+        pthread_mutex_lock(&pool_mutex);
+        auto iter = find(pool_contexts.begin(), pool_contexts.end(), &context);
+        if (iter != pool_contexts.end()) pool_contexts.erase(iter);
+        while (context.active_worker_num > 0) pthread_cond_wait(&pool_done_signal, &pool_mutex);
+        pthread_mutex_unlock(&pool_mutex);
+    }
+    return;
+}
+
+int KD_FOREST::Collect_Revived(Forest_Task_Context & context, PointVector * Revived_Points){
+    int revived_num = 0;
+    for (int i = 0; i < context.tasks.size(); i++){
+        revived_num += context.tasks[i].revived_num;
+        if (Revived_Points != nullptr) Revived_Points->insert(Revived_Points->end(), context.tasks[i].points.begin(), context.tasks[i].points.end());
+    }
+    return revived_num;
+}
+
+void * KD_FOREST::worker_thread_ptr(void * arg){
+    KD_FOREST * handle = (KD_FOREST *) arg;
+    handle->Worker_Loop();
+    return nullptr;
+}
+
+void KD_FOREST::Worker_Loop(){
+    pthread_mutex_lock(&pool_mutex);
+    while (!pool_termination){
+        if (pool_contexts.empty()){
+            pthread_cond_wait(&pool_signal, &pool_mutex);
+            continue;
+        }
+        Forest_Task_Context * context = pool_contexts.front();
+        if (--context->open_worker_num == 0) pool_contexts.pop_front();
+        context->active_worker_num++;
+        pthread_mutex_unlock(&pool_mutex);
+        Task_Loop(*context);
+        pthread_mutex_lock(&pool_mutex);
+        if (--context->active_worker_num == 0) pthread_cond_broadcast(&pool_done_signal);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return;
+}
+
+void KD_FOREST::Task_Loop(Forest_Task_Context & context){
+    int task_id;
+    while ((task_id = context.next_task++) < int(context.tasks.size())){
+        Run_Task(context, context.tasks[task_id]);
+    }
+    return;
+}
+
+void KD_FOREST::Run_Task(Forest_Task_Context & context, Forest_Task_Type & task){
+    KD_TREE * tree = nullptr;
+    // Evicted tiles are paged in by the task, so several tiles are read in parallel
+    if (context.op != FOREST_SEARCH) tree = Load_Tile(task.tile);
+    switch (context.op)
+    {
+    case FOREST_BUILD:
+        tree->Build(std::move(task.points));
+        break;
+    case FOREST_ADD_POINTS:
+    case FOREST_DOWNSAMPLE_ADD_POINTS:
+        // A KD_TREE has to be built before points are added to it
+        if (tree->size() == 0){
+            tree->Build(std::move(task.points));
+        } else {
+            tree->Add_Points(task.points, context.op == FOREST_DOWNSAMPLE_ADD_POINTS);
+        }
+        break;
+    case FOREST_DELETE_POINTS:
+        tree->Delete_Points(task.points);
+        break;
+    case FOREST_ADD_BOXES:
+        task.revived_num = tree->Add_Point_Boxes(task.boxes, context.record_revived ? &task.points : nullptr);
+        break;
+    case FOREST_DELETE_BOXES:
+        tree->Delete_Point_Boxes(task.boxes);
+        break;
+    case FOREST_ADD_REGIONS:
+        task.revived_num = tree->Add_Point_Regions(task.regions, context.record_revived ? &task.points : nullptr);
+        break;
+    case FOREST_DELETE_REGIONS:
+        tree->Delete_Point_Regions(task.regions);
+        break;
+    case FOREST_SEARCH:
+        for (int i = task.query_begin; i < task.query_end; i++){
+            Nearest_Search((*context.query_points)[i], context.k_nearest, (*context.nearest_points)[i], (*context.point_distance)[i]);
+        }
+        break;
+    default:
+        break;
+    }
+    return;
+}
+
+float KD_FOREST::calc_tile_dist(PointType point, int ix, int iy){
+    float dx = max(max(ix * tile_size - point.x, point.x - (ix + 1) * tile_size), 0.0f);
+    float dy = max(max(iy * tile_size - point.y, point.y - (iy + 1) * tile_size), 0.0f);
+    return dx * dx + dy * dy;
+}
+
+void KD_FOREST::Search_Tile(int ix, int iy, PointType point, int k_nearest, PointType_Heap & q){
+    Forest_Tile_Type * tile = Find_Tile(ix, iy);
+    if (tile == nullptr) return;
+    KD_TREE * tree = Load_Tile(tile);
+    tree->Nearest_Search(tile_search_context, point, k_nearest, tile_points, tile_dist);
+    for (int i = 0; i < tile_points.size(); i++){
+        if (q.size() >= k_nearest && tile_dist[i] >= q.top().dist) break;
+        if (q.size() >= k_nearest) q.pop();
+        q.push(PointType_CMP(tile_points[i], tile_dist[i]));
+    }
+    return;
+}
+
+void KD_FOREST::Set_paging(const char * directory, int max_resident_point_num){
+    paging_directory = directory;
+    max_resident_points = max_resident_point_num;
+    if (!loader_started){
+        pthread_create(&loader_thread, NULL, loader_thread_ptr, (void*) this);
+        loader_started = true;
+    }
+    pthread_mutex_lock(&update_mutex);
+    Evict_Tiles();
+    pthread_mutex_unlock(&update_mutex);
+    return;
+}
+
+void KD_FOREST::Update_Position(PointType position){
+    if (!loader_started) return;
+    Prefetch_Tiles(position);
+    // Also prefetch where the motion since the previous position leads to
+    if (has_position){
+        PointType ahead;
+        ahead.x = position.x + (position.x - last_position.x) * Forest_Prefetch_Steps;
+        ahead.y = position.y + (position.y - last_position.y) * Forest_Prefetch_Steps;
+        ahead.z = position.z;
+        Prefetch_Tiles(ahead);
+    }
+    last_position = position;
+    has_position = true;
+    return;
+}
+
+void KD_FOREST::Prefetch_Tiles(PointType center){
+    int ix_min = tile_index(center.x - Forest_Prefetch_Radius), ix_max = tile_index(center.x + Forest_Prefetch_Radius);
+    int iy_min = tile_index(center.y - Forest_Prefetch_Radius), iy_max = tile_index(center.y + Forest_Prefetch_Radius);
+    pthread_rwlock_rdlock(&tiles_rwlock);
+    pthread_mutex_lock(&paging_mutex);
+    for (int ix = ix_min; ix <= ix_max; ix++){
+        for (int iy = iy_min; iy <= iy_max; iy++){
+            Forest_Tile_Type * tile = Find_Tile(ix, iy);
+            if (tile == nullptr || tile->tree != nullptr || tile->loading) continue;
+            tile->last_use = ++use_clock;
+            load_queue.push(tile);
+        }
+    }
+    pthread_cond_signal(&load_signal);
+    pthread_mutex_unlock(&paging_mutex);
+    pthread_rwlock_unlock(&tiles_rwlock);
+    return;
+}
+
+KD_TREE * KD_FOREST::Load_Tile(Forest_Tile_Type * tile){
+    tile->last_use = ++use_clock;
+    KD_TREE * tree = tile->tree;
+    if (tree != nullptr) return tree;
+    pthread_mutex_lock(&paging_mutex);
+    // Another thread may be reading the same tile
+    while (tile->loading) pthread_cond_wait(&loaded_signal, &paging_mutex);
+    tree = tile->tree;
+    if (tree == nullptr){
+        tile->loading = true;
+        loading_num++;
+        pthread_mutex_unlock(&paging_mutex);
+        tree = Read_Tile(tile);
+        pthread_mutex_lock(&paging_mutex);
+        tile->tree = tree;
+        tile->loading = false;
+        resident_estimate += tree->size();
+        loading_num--;
+        pthread_cond_broadcast(&loaded_signal);
+        // Tiles paged in by searches are evicted by the loader thread, the writer evicts after each update
+        evict_pending = true;
+        pthread_cond_signal(&load_signal);
+    }
+    pthread_mutex_unlock(&paging_mutex);
+    return tree;
+}
+
+KD_TREE * KD_FOREST::Read_Tile(Forest_Tile_Type * tile){
+    char file_name[1024];
+    Forest_Tile_Header header;
+    PointVector points;
+    KD_TREE * tree = new KD_TREE(delete_criterion_param, balance_criterion_param, downsample_size);
+    tile_file_name(tile, file_name, sizeof(file_name));
+    FILE * fp = fopen(file_name, "rb");
+    if (fp == nullptr) return tree;
+    if (fread(&header, sizeof(header), 1, fp) == 1 && memcmp(header.magic, "IKDT", 4) == 0){
+        points.resize(header.point_num);
+        if (fread(points.data(), sizeof(PointType), header.point_num, fp) != header.point_num){
+            printf("Failed to read tile %d %d from %s\n", tile->ix, tile->iy, file_name);
+            PointVector ().swap(points);
+        }
+    }
+    fclose(fp);
+    remove(file_name);
+    if (points.size() > 0) tree->Build(std::move(points));
+    return tree;
+}
+
+bool KD_FOREST::Write_Tile(Forest_Tile_Type * tile, PointVector & points){
+    char file_name[1024];
+    Forest_Tile_Header header;
+    memcpy(header.magic, "IKDT", 4);
+    header.ix = tile->ix;
+    header.iy = tile->iy;
+    header.point_num = points.size();
+    tile_file_name(tile, file_name, sizeof(file_name));
+    FILE * fp = fopen(file_name, "wb");
+    if (fp == nullptr) return false;
+    bool success = fwrite(&header, sizeof(header), 1, fp) == 1 && fwrite(points.data(), sizeof(PointType), points.size(), fp) == points.size();
+    success = (fclose(fp) == 0) && success;
+    if (!success) remove(file_name);
+    return success;
+}
+
+void KD_FOREST::tile_file_name(Forest_Tile_Type * tile, char * file_name, int length){
+    snprintf(file_name, length, "%s/tile_%d_%d.bin", paging_directory.c_str(), tile->ix, tile->iy);
+    return;
+}
+
+void KD_FOREST::Evict_Tiles(){
+    if (max_resident_points <= 0) return;
+    vector<pair<uint64_t, Forest_Tile_Type *>> resident_tiles;
+    int resident_points = 0;
+    pthread_mutex_lock(&paging_mutex);
+    for (auto & tile : tiles){
+        KD_TREE * tree = tile.second->tree;
+        if (tree == nullptr) continue;
+        resident_points += tree->size();
+        resident_tiles.push_back(make_pair(tile.second->last_use.load(), tile.second));
+    }
+    // Tiles are paged in under paging_mutex, so the count is exact here
+    resident_estimate = resident_points;
+    pthread_mutex_unlock(&paging_mutex);
+    if (resident_points > max_resident_points) sort(resident_tiles.begin(), resident_tiles.end());
+    PointVector points;
+    for (int i = 0; i < resident_tiles.size() && resident_points > max_resident_points; i++){
+        Forest_Tile_Type * tile = resident_tiles[i].second;
+        KD_TREE * tree = tile->tree;
+        tree->Export_Points(points);
+        if (!Write_Tile(tile, points)){
+            printf("Failed to write tile %d %d to %s\n", tile->ix, tile->iy, paging_directory.c_str());
+            break;
+        }
+        resident_points -= tree->size();
+        resident_estimate -= tree->size();
+        pthread_rwlock_wrlock(&tiles_rwlock);
+        tile->tree = nullptr;
+        tile->disk_point_num = points.size();
+        pthread_rwlock_unlock(&tiles_rwlock);
+        pthread_mutex_lock(&paging_mutex);
+        tree->acquire_removed_points(Points_evicted);
+        pthread_mutex_unlock(&paging_mutex);
+        delete tree;
+    }
+    pthread_mutex_lock(&paging_mutex);
+    evict_round++;
+    pthread_cond_broadcast(&evicted_signal);
+    pthread_mutex_unlock(&paging_mutex);
+    return;
+}
+
+void KD_FOREST::Wait_For_Eviction(){
+    // Called without any lock held, by a search that finds the tiles paged in far over the budget
+    pthread_mutex_lock(&paging_mutex);
+    uint64_t round = evict_round;
+    evict_waiter_num++;
+    evict_pending = true;
+    pthread_cond_signal(&load_signal);
+    while (evict_round == round && !loader_termination) pthread_cond_wait(&evicted_signal, &paging_mutex);
+    evict_waiter_num--;
+    pthread_mutex_unlock(&paging_mutex);
+    return;
+}
+
+void * KD_FOREST::loader_thread_ptr(void * arg){
+    KD_FOREST * handle = (KD_FOREST *) arg;
+    handle->Loader_Loop();
+    return nullptr;
+}
+
+void KD_FOREST::Loader_Loop(){
+    pthread_mutex_lock(&paging_mutex);
+    while (!loader_termination){
+        if (evict_pending){
+            evict_pending = false;
+            bool evict = evict_waiter_num > 0 || resident_estimate > max_resident_points;
+            pthread_mutex_unlock(&paging_mutex);
+            if (evict){
+                pthread_mutex_lock(&update_mutex);
+                Evict_Tiles();
+                pthread_mutex_unlock(&update_mutex);
+            }
+            pthread_mutex_lock(&paging_mutex);
+            continue;
+        }
+        if (load_queue.empty()){
+            pthread_cond_wait(&load_signal, &paging_mutex);
+            continue;
+        }
+        Forest_Tile_Type * tile = load_queue.front();
+        load_queue.pop();
+        if (tile->tree != nullptr || tile->loading) continue;
+        tile->loading = true;
+        loading_num++;
+        pthread_mutex_unlock(&paging_mutex);
+        KD_TREE * tree = Read_Tile(tile);
+        pthread_mutex_lock(&paging_mutex);
+        tile->tree = tree;
+        tile->loading = false;
+        resident_estimate += tree->size();
+        loading_num--;
+        evict_pending = true;
+        pthread_cond_broadcast(&loaded_signal);
+    }
+    pthread_mutex_unlock(&paging_mutex);
+    return;
+}
@@ -0,0 +1,159 @@
+#pragma once
+#include "ikd_Tree.h"
+#include <unordered_map>
+#include <string>
+#include <deque>
+
+#define Forest_Tile_Size 50.0f
+#define Forest_Max_Thread_Num 64
+#define Forest_Search_Chunk 256
+#define Forest_Prefetch_Radius 60.0f
+#define Forest_Prefetch_Steps 5
+// Searches wait for the loader thread to evict once the resident points exceed the budget by this fraction
+#define Forest_Resident_Slack 0.5f
+
+enum forest_task_set {FOREST_BUILD, FOREST_ADD_POINTS, FOREST_DOWNSAMPLE_ADD_POINTS, FOREST_DELETE_POINTS, FOREST_ADD_BOXES, FOREST_DELETE_BOXES, FOREST_ADD_REGIONS, FOREST_DELETE_REGIONS, FOREST_SEARCH};
+
+class KD_FOREST;
+
+// A tile is resident when tree is set, otherwise its valid points are stored in a file of the paging directory
+struct Forest_Tile_Type{
+    int ix, iy;
+    atomic<KD_TREE *> tree{nullptr};
+    atomic<uint64_t> last_use{0};
+    int disk_point_num = 0;
+    bool loading = false;
+};
+
+// File layout of an evicted tile: header followed by disk_point_num PointType
+struct Forest_Tile_Header{
+    char magic[4];
+    int32_t ix, iy;
+    uint32_t point_num;
+};
+
+// Work of one task: the points, boxes and regions routed to one tile, or a slice of a search batch
+struct Forest_Task_Type{
+    Forest_Tile_Type * tile = nullptr;
+    PointVector points;
+    vector<BoxPointType> boxes;
+    vector<RegionType> regions;
+    int query_begin = 0, query_end = 0;
+    // Points revived by the boxes or regions of the task, listed in points when the context asks for them
+    int revived_num = 0;
+};
+
+// One parallel operation, owned by the calling thread so that searches and updates can overlap
+struct Forest_Task_Context{
+    KD_FOREST * forest;
+    forest_task_set op;
+    vector<Forest_Task_Type> tasks;
+    bool record_revived = false;
+    atomic<int> next_task{0};
+    // Workers of the pool that may still join, and those running tasks; guarded by the pool mutex
+    int open_worker_num = 0, active_worker_num = 0;
+    int k_nearest = 0;
+    PointVector * query_points = nullptr;
+    vector<PointVector> * nearest_points = nullptr;
+    vector<vector<float>> * point_distance = nullptr;
+};
+
+/*
+    Map sharded into square tiles on the x-y plane, each backed by its own KD_TREE and rebuild thread.
+    Batches are routed to their tiles and the tiles are updated in parallel; nearest search visits the
+    tiles in order of distance and merges their results. The threading contract is the one of KD_TREE:
+    one thread updates the forest while any number of threads search it.
+
+    With Set_paging, the least recently used tiles are written to disk after each update until at most
+    max_resident_points stay in memory; after the tiles paged in by searches, the loader thread does the
+    same. Build then builds and pages out a few tiles at a time. An evicted tile is read back when an
+    operation touches it, or ahead of time by the loader thread for the tiles around and ahead of the
+    positions given to Update_Position, which is called from the writer thread.
+*/
+class KD_FOREST
+{
+private:
+    float tile_size;
+    float delete_criterion_param, balance_criterion_param, downsample_size;
+    int thread_num;
+    // thread_num - 1 workers started with the forest, the calling thread runs tasks as well
+    pthread_t workers[Forest_Max_Thread_Num];
+    int worker_num = 0;
+    bool pool_termination = false;
+    deque<Forest_Task_Context *> pool_contexts;
+    pthread_mutex_t pool_mutex;
+    pthread_cond_t pool_signal, pool_done_signal;
+    int tile_min[2] = {0, 0}, tile_max[2] = {-1, -1};
+    unordered_map<int64_t, Forest_Tile_Type *> tiles;
+    // Guards the tile table, which the writer extends while searches walk it
+    pthread_rwlock_t tiles_rwlock;
+    atomic<uint64_t> use_clock{0};
+    uint32_t point_id_num = 0;
+    // Paging
+    string paging_directory;
+    int max_resident_points = 0;
+    bool has_position = false;
+    PointType last_position;
+    PointVector Points_evicted;
+    pthread_t loader_thread;
+    bool loader_started = false, loader_termination = false, evict_pending = false;
+    int evict_waiter_num = 0;
+    uint64_t evict_round = 0;
+    // Resident points as of the last eviction, plus the tiles paged in since
+    atomic<int> resident_estimate{0};
+    // Held by the writer for each update and by the loader thread while it evicts tiles
+    pthread_mutex_t update_mutex;
+    int loading_num = 0;
+    queue<Forest_Tile_Type *> load_queue;
+    pthread_mutex_t paging_mutex;
+    pthread_cond_t load_signal, loaded_signal, evicted_signal;
+    static int64_t tile_key(int ix, int iy);
+    int tile_index(float value);
+    void Assign_Point_IDs(PointVector & points);
+    Forest_Tile_Type * Find_Tile(int ix, int iy);
+    Forest_Tile_Type * Get_Tile(int ix, int iy);
+    void Clear_Tiles();
+    KD_TREE * Load_Tile(Forest_Tile_Type * tile);
+    KD_TREE * Read_Tile(Forest_Tile_Type * tile);
+    bool Write_Tile(Forest_Tile_Type * tile, PointVector & points);
+    void tile_file_name(Forest_Tile_Type * tile, char * file_name, int length);
+    void Evict_Tiles();
+    void Wait_For_Eviction();
+    void Prefetch_Tiles(PointType center);
+    static void * loader_thread_ptr(void * arg);
+    void Loader_Loop();
+    void Route_Points(PointVector & points, forest_task_set op);
+    int Route_Boxes(vector<BoxPointType> & boxes, forest_task_set op, PointVector * Revived_Points = nullptr);
+    int Route_Regions(vector<RegionType> & regions, forest_task_set op, PointVector * Revived_Points = nullptr);
+    int Collect_Revived(Forest_Task_Context & context, PointVector * Revived_Points);
+    void Run_Tasks(Forest_Task_Context & context);
+    static void * worker_thread_ptr(void * arg);
+    void Worker_Loop();
+    void Task_Loop(Forest_Task_Context & context);
+    void Run_Task(Forest_Task_Context & context, Forest_Task_Type & task);
+    float calc_tile_dist(PointType point, int ix, int iy);
+    void Search_Tile(int ix, int iy, PointType point, int k_nearest, PointType_Heap & q);
+
+public:
+    KD_FOREST(float tile_length = Forest_Tile_Size, float delete_param = 0.5, float balance_param = 0.6, float box_length = 0.2, int thread_number = 0);
+    ~KD_FOREST();
+    int size();
+    int validnum();
+    int tile_num();
+    uint32_t next_point_id();
+    void Build(PointVector point_cloud);
+    void Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> & Point_Distance);
+    // Queries are split between the worker threads, results are stored at the index of each query
+    void Nearest_Search_Batch(PointVector & Query_Points, int k_nearest, vector<PointVector> & Nearest_Points, vector<vector<float>> & Point_Distance);
+    void Add_Points(PointVector & PointToAdd, bool downsample_on);
+    // Return the number of points revived over all tiles, appended to Revived_Points when given
+    int Add_Point_Boxes(vector<BoxPointType> & BoxPoints, PointVector * Revived_Points = nullptr);
+    void Delete_Points(PointVector & PointToDel);
+    void Delete_Point_Boxes(vector<BoxPointType> & BoxPoints);
+    int Add_Point_Regions(vector<RegionType> & Regions, PointVector * Revived_Points = nullptr);
+    void Delete_Point_Regions(vector<RegionType> & Regions);
+    void acquire_removed_points(PointVector & removed_points);
+    void Set_paging(const char * directory, int max_resident_point_num);
+    void Update_Position(PointType position);
+    int resident_num();
+};
@@ -12,14 +12,23 @@ KD_TREE::KD_TREE(float delete_param, float balance_param, float box_length) {
     downsample_size = box_length;
     queue<Operation_Logger_Type> ().swap(Rebuild_Logger);            
     termination_flag = false;
+    pthread_mutex_init(&trace_mutex, NULL);
+    pthread_mutex_init(&async_mutex, NULL);
+    pthread_cond_init(&async_signal, NULL);
+    pthread_cond_init(&async_applied_signal, NULL);
     start_thread(); 
+    Reset_Stats();
 }
 
 KD_TREE::~KD_TREE()
 {
+    stop_async_thread();
+    Stop_Trace();
+    pthread_mutex_destroy(&trace_mutex);
     stop_thread();
     Delete_Storage_Disabled = true;
     delete_tree_nodes(&Root_Node, NOT_RECORD);
+    delete STATIC_ROOT_NODE;
     PointVector ().swap(PCL_Storage);
     queue<Operation_Logger_Type> ().swap(Rebuild_Logger); 
 }
@@ -36,6 +45,19 @@ void KD_TREE::set_downsample_param(float downsample_param){
     downsample_size = downsample_param;
 }
 
+void KD_TREE::Set_search_prefetch(bool prefetch_on){
+    search_prefetch = prefetch_on;
+}
+
+void KD_TREE::Set_voxel_cache(float voxel_size, int max_ring){
+    lock_search_write();
+    voxel_cache_size = max(voxel_size, 0.0f);
+    voxel_cache_ring = max(max_ring, 0);
+    Cache_Rebuild();
+    pthread_rwlock_unlock(&search_rwlock);
+    return;
+}
+
 void KD_TREE::InitializeKDTree(float delete_param, float balance_param, float box_length){
     Set_delete_criterion_param(delete_param);
     Set_balance_criterion_param(balance_param);
@@ -63,9 +85,9 @@ void KD_TREE::InitTreeNode(KD_TREE_NODE * root){
     root->need_push_down_to_left = false;
     root->need_push_down_to_right = false;
     root->point_downsample_deleted = false;
-    root->alpha_bal = 0.5;
-    root->alpha_del = 0.0;
-    pthread_mutex_init(&(root->push_down_mutex_lock),NULL);
+    root->tree_downsample_deleted = false;
+    root->has_downsample_deleted = false;
+    root->ref_num = 1;
 }   
 
 int KD_TREE::size(){
@@ -119,6 +141,7 @@ BoxPointType KD_TREE::tree_range(){
 int KD_TREE::validnum(){
     int s = 0;
     if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node){
+        if (Root_Node == nullptr) return 0;
         return (Root_Node->TreeSize - Root_Node->invalid_point_num);
     } else {
         if (!pthread_mutex_trylock(&working_flag_mutex)){
@@ -131,23 +154,238 @@ int KD_TREE::validnum(){
     }
 }
 
+// Scratch buffers of the searches that are not given a context
+static thread_local Nearest_Search_Context default_search_context;
+
+#if KD_TREE_STATS
+// Nodes visited by the searches of the current operation on this thread
+static thread_local uint64_t stats_node_visited = 0;
+
+static uint64_t stats_now_ns(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return uint64_t(now.tv_sec) * 1000000000ull + now.tv_nsec;
+}
+
+void Stats_Counter_Type::Record(uint64_t duration_ns){
+    int index = 0;
+    uint64_t duration_us = duration_ns / 1000;
+    while (duration_us > 0 && index < Stats_Bucket_Num - 1){
+        duration_us >>= 1;
+        index++;
+    }
+    count.fetch_add(1, memory_order_relaxed);
+    total_ns.fetch_add(duration_ns, memory_order_relaxed);
+    bucket[index].fetch_add(1, memory_order_relaxed);
+    uint64_t max_duration = max_ns.load(memory_order_relaxed);
+    while (duration_ns > max_duration && !max_ns.compare_exchange_weak(max_duration, duration_ns, memory_order_relaxed));
+    return;
+}
+
+void Stats_Counter_Type::Copy(Stats_Histogram_Type & histogram){
+    histogram.count = count.load(memory_order_relaxed);
+    histogram.total_ns = total_ns.load(memory_order_relaxed);
+    histogram.max_ns = max_ns.load(memory_order_relaxed);
+    for (int i = 0; i < Stats_Bucket_Num; i++) histogram.bucket[i] = bucket[i].load(memory_order_relaxed);
+    return;
+}
+
+void Stats_Counter_Type::Reset(){
+    count.store(0);
+    total_ns.store(0);
+    max_ns.store(0);
+    for (int i = 0; i < Stats_Bucket_Num; i++) bucket[i].store(0);
+    return;
+}
+#endif
+
+uint64_t KD_TREE::Stats_Begin(){
+#if KD_TREE_STATS
+    stats_node_visited = 0;
+    return stats_now_ns();
+#else
+    return 0;
+#endif
+}
+
+void KD_TREE::Stats_End(stats_operation_set op, uint64_t start_ns){
+#if KD_TREE_STATS
+    operation_stats[op].Record(stats_now_ns() - start_ns);
+    node_visited_stats[op].fetch_add(stats_node_visited, memory_order_relaxed);
+#else
+    (void) op;
+    (void) start_ns;
+#endif
+    return;
+}
+
+// Lock acquisitions are timed only when the lock is contended
+void KD_TREE::lock_search_read(){
+#if KD_TREE_STATS
+    lock_acquired_stats[STATS_SEARCH_READ_LOCK].fetch_add(1, memory_order_relaxed);
+    if (pthread_rwlock_tryrdlock(&search_rwlock) == 0) return;
+    uint64_t start_ns = stats_now_ns();
+    pthread_rwlock_rdlock(&search_rwlock);
+    lock_stats[STATS_SEARCH_READ_LOCK].Record(stats_now_ns() - start_ns);
+#else
+    pthread_rwlock_rdlock(&search_rwlock);
+#endif
+    return;
+}
+
+void KD_TREE::lock_search_write(){
+#if KD_TREE_STATS
+    lock_acquired_stats[STATS_SEARCH_WRITE_LOCK].fetch_add(1, memory_order_relaxed);
+    if (pthread_rwlock_trywrlock(&search_rwlock) == 0) return;
+    uint64_t start_ns = stats_now_ns();
+    pthread_rwlock_wrlock(&search_rwlock);
+    lock_stats[STATS_SEARCH_WRITE_LOCK].Record(stats_now_ns() - start_ns);
+#else
+    pthread_rwlock_wrlock(&search_rwlock);
+#endif
+    return;
+}
+
+void KD_TREE::lock_working_flag(){
+#if KD_TREE_STATS
+    lock_acquired_stats[STATS_WORKING_FLAG_LOCK].fetch_add(1, memory_order_relaxed);
+    if (pthread_mutex_trylock(&working_flag_mutex) == 0) return;
+    uint64_t start_ns = stats_now_ns();
+    pthread_mutex_lock(&working_flag_mutex);
+    lock_stats[STATS_WORKING_FLAG_LOCK].Record(stats_now_ns() - start_ns);
+#else
+    pthread_mutex_lock(&working_flag_mutex);
+#endif
+    return;
+}
+
+Tree_Stats_Type KD_TREE::Get_Stats(){
+    Tree_Stats_Type stats;
+#if KD_TREE_STATS
+    for (int i = 0; i < STATS_OPERATION_NUM; i++){
+        operation_stats[i].Copy(stats.operation[i]);
+        stats.node_visited[i] = node_visited_stats[i].load(memory_order_relaxed);
+    }
+    for (int i = 0; i < STATS_LOCK_NUM; i++){
+        lock_stats[i].Copy(stats.lock_wait[i]);
+        stats.lock_acquired[i] = lock_acquired_stats[i].load(memory_order_relaxed);
+    }
+    rebuild_stats.Copy(stats.rebuild);
+    stats.rebuild_point_num = rebuild_point_stats.load(memory_order_relaxed);
+    stats.rebuild_max_point_num = rebuild_max_point_stats.load(memory_order_relaxed);
+    stats.writer_rebuild_num = writer_rebuild_stats.load(memory_order_relaxed);
+    stats.writer_rebuild_point_num = writer_rebuild_point_stats.load(memory_order_relaxed);
+    stats.voxel_cache_hit_num = voxel_cache_hit_stats.load(memory_order_relaxed);
+    stats.voxel_cache_miss_num = voxel_cache_miss_stats.load(memory_order_relaxed);
+#endif
+    pthread_mutex_lock(&rebuild_logger_mutex_lock);
+    stats.logger_depth = Rebuild_Logger.size();
+#if KD_TREE_STATS
+    stats.logger_max_depth = logger_max_depth;
+#endif
+    pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+    stats.tree_size = size();
+    stats.valid_num = validnum();
+    if (stats.tree_size > 0) stats.tombstone_ratio = 1.0f - float(stats.valid_num) / float(stats.tree_size);
+    return stats;
+}
+
+void KD_TREE::Reset_Stats(){
+#if KD_TREE_STATS
+    for (int i = 0; i < STATS_OPERATION_NUM; i++){
+        operation_stats[i].Reset();
+        node_visited_stats[i].store(0);
+    }
+    for (int i = 0; i < STATS_LOCK_NUM; i++){
+        lock_stats[i].Reset();
+        lock_acquired_stats[i].store(0);
+    }
+    rebuild_stats.Reset();
+    rebuild_point_stats.store(0);
+    rebuild_max_point_stats.store(0);
+    writer_rebuild_stats.store(0);
+    writer_rebuild_point_stats.store(0);
+    voxel_cache_hit_stats.store(0);
+    voxel_cache_miss_stats.store(0);
+    pthread_mutex_lock(&rebuild_logger_mutex_lock);
+    logger_max_depth = 0;
+    pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+#endif
+    return;
+}
+
+bool KD_TREE::Start_Trace(const char * file_name){
+    Wait_For_Async();
+    Stop_Trace();
+    FILE * fp = fopen(file_name, "wb");
+    if (fp == nullptr) return false;
+    Trace_Header_Type header;
+    memcpy(header.magic, "IKDR", 4);
+    header.version = Trace_Version;
+    header.point_size = sizeof(PointType);
+    header.delete_param = delete_criterion_param;
+    header.balance_param = balance_criterion_param;
+    header.box_length = downsample_size;
+    fwrite(&header, sizeof(header), 1, fp);
+    // The replay starts from the points the tree holds now
+    PointVector points;
+    lock_search_read();
+    flatten(Root_Node, points);
+    pthread_rwlock_unlock(&search_rwlock);
+    if (!points.empty()){
+        Trace_Record_Type record;
+        record.op = TRACE_BUILD;
+        record.param = 0;
+        record.count = points.size();
+        record.thread = 0;
+        record.time_ns = 0;
+        fwrite(&record, sizeof(record), 1, fp);
+        fwrite(points.data(), sizeof(PointType), points.size(), fp);
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&trace_mutex);
+    trace_fp = fp;
+    trace_start_ns = uint64_t(now.tv_sec) * 1000000000ull + now.tv_nsec;
+    trace_on.store(true);
+    pthread_mutex_unlock(&trace_mutex);
+    return true;
+}
+
+void KD_TREE::Stop_Trace(){
+    pthread_mutex_lock(&trace_mutex);
+    trace_on.store(false);
+    if (trace_fp != nullptr) fclose(trace_fp);
+    trace_fp = nullptr;
+    pthread_mutex_unlock(&trace_mutex);
+    return;
+}
+
+void KD_TREE::Trace_Record(trace_operation_set op, int param, const void * data, uint32_t count, size_t item_size){
+    static atomic<uint32_t> thread_num(0);
+    static thread_local uint32_t thread_index = thread_num++;
+    if (!trace_on.load(memory_order_relaxed)) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    Trace_Record_Type record;
+    record.op = op;
+    record.param = param;
+    record.count = count;
+    record.thread = thread_index;
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_fp != nullptr){
+        record.time_ns = uint64_t(now.tv_sec) * 1000000000ull + now.tv_nsec - trace_start_ns;
+        fwrite(&record, sizeof(record), 1, trace_fp);
+        if (count > 0) fwrite(data, item_size, count, trace_fp);
+    }
+    pthread_mutex_unlock(&trace_mutex);
+    return;
+}
+
 void KD_TREE::root_alpha(float &alpha_bal, float &alpha_del){
-    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node){
-        alpha_bal = Root_Node->alpha_bal;
-        alpha_del = Root_Node->alpha_del;
-        return;
-    } else {
-        if (!pthread_mutex_trylock(&working_flag_mutex)){
-            alpha_bal = Root_Node->alpha_bal;
-            alpha_del = Root_Node->alpha_del;
-            pthread_mutex_unlock(&working_flag_mutex);
-            return;
-        } else {
-            alpha_bal = alpha_bal_tmp;
-            alpha_del = alpha_del_tmp;      
-            return;
-        }
-    }    
+    alpha_bal = root_alpha_bal;
+    alpha_del = root_alpha_del;
+    return;
 }
 
 void KD_TREE::start_thread(){
@@ -156,7 +394,15 @@ void KD_TREE::start_thread(){
     pthread_mutex_init(&rebuild_logger_mutex_lock, NULL);
     pthread_mutex_init(&points_deleted_rebuild_mutex_lock, NULL); 
     pthread_mutex_init(&working_flag_mutex, NULL);
-    pthread_mutex_init(&search_flag_mutex, NULL);
+    pthread_cond_init(&rebuild_signal, NULL);
+    pthread_rwlockattr_t search_rwlock_attr;
+    pthread_rwlockattr_init(&search_rwlock_attr);
+#ifdef __GLIBC__
+    // Keep a continuous stream of searches from starving the writer
+    pthread_rwlockattr_setkind_np(&search_rwlock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&search_rwlock, &search_rwlock_attr);
+    pthread_rwlockattr_destroy(&search_rwlock_attr);
     pthread_create(&rebuild_thread, NULL, multi_thread_ptr, (void*) this);
     printf("Multi thread started \n");    
 }
@@ -166,30 +412,36 @@ void KD_TREE::stop_thread(){
     pthread_mutex_lock(&termination_flag_mutex_lock);
     termination_flag = true;
     pthread_mutex_unlock(&termination_flag_mutex_lock);
+    pthread_mutex_lock(&rebuild_ptr_mutex_lock);
+    pthread_cond_signal(&rebuild_signal);
+    pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
     if (rebuild_thread) pthread_join(rebuild_thread, NULL);
     pthread_mutex_destroy(&termination_flag_mutex_lock);
     pthread_mutex_destroy(&rebuild_logger_mutex_lock);
     pthread_mutex_destroy(&rebuild_ptr_mutex_lock);
     pthread_mutex_destroy(&points_deleted_rebuild_mutex_lock);
     pthread_mutex_destroy(&working_flag_mutex);
-    pthread_mutex_destroy(&search_flag_mutex);     
+    pthread_cond_destroy(&rebuild_signal);
+    pthread_rwlock_destroy(&search_rwlock);     
 }
 
 void * KD_TREE::multi_thread_ptr(void * arg){
     KD_TREE * handle = (KD_TREE*) arg;
     handle->multi_thread_rebuild();
+    return nullptr;
 }    
 
 void KD_TREE::multi_thread_rebuild(){
     bool terminated = false;
     KD_TREE_NODE * father_ptr, ** new_node_ptr;
+    struct timespec timeout;
     pthread_mutex_lock(&termination_flag_mutex_lock);
     terminated = termination_flag;
     pthread_mutex_unlock(&termination_flag_mutex_lock);
     // Not sure whether we need a flag to notice this thread to finish and stop
     while (!terminated){
         pthread_mutex_lock(&rebuild_ptr_mutex_lock);
-        pthread_mutex_lock(&working_flag_mutex);
+        lock_working_flag();
         if (Rebuild_Ptr != nullptr ){                    
             /* Traverse and copy */
             if (Rebuild_Logger.size()>0){
@@ -197,15 +449,18 @@ void KD_TREE::multi_thread_rebuild(){
             }
             rebuild_flag = true;
             max_rebuild_num = max(max_rebuild_num, (*Rebuild_Ptr)->TreeSize);
+#if KD_TREE_STATS
+            uint64_t rebuild_start_ns = stats_now_ns();
+            uint64_t rebuild_point_num = (*Rebuild_Ptr)->TreeSize;
+#endif
             if (*Rebuild_Ptr == Root_Node) {
                 Treesize_tmp = Root_Node->TreeSize;
                 Validnum_tmp = Root_Node->TreeSize - Root_Node->invalid_point_num;
-                alpha_bal_tmp = Root_Node->alpha_bal;
-                alpha_del_tmp = Root_Node->alpha_del;
             }
             KD_TREE_NODE * old_root_node = (*Rebuild_Ptr);                            
             father_ptr = (*Rebuild_Ptr)->father_ptr;  
             PointVector ().swap(Rebuild_PCL_Storage);
+            Rebuild_PCL_Storage.reserve((*Rebuild_Ptr)->TreeSize);
             flatten(*Rebuild_Ptr, Rebuild_PCL_Storage); 
             pthread_mutex_unlock(&working_flag_mutex);   
             /* Rebuild and update missed operations*/
@@ -213,35 +468,47 @@ void KD_TREE::multi_thread_rebuild(){
             KD_TREE_NODE * new_root_node = nullptr;            
             if (int(Rebuild_PCL_Storage.size()) > 0){               
                 BuildTree(&new_root_node, 0, Rebuild_PCL_Storage.size()-1, Rebuild_PCL_Storage);             
-                // Rebuild has been done. Updates the blocked operations into the new tree  
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                while (!Rebuild_Logger.empty()){
-                    Operation = Rebuild_Logger.front();
-                    Rebuild_Logger.pop();
-                    pthread_mutex_unlock(&rebuild_logger_mutex_lock);                  
-                    run_operation(&new_root_node, Operation);                                       
-                    pthread_mutex_lock(&rebuild_logger_mutex_lock);               
-                }   
-               pthread_mutex_unlock(&rebuild_logger_mutex_lock);
-            }  
+            }
+            PointVector ().swap(Rebuild_PCL_Storage);
+            // Rebuild has been done. Updates the blocked operations into the new tree  
+            pthread_mutex_lock(&rebuild_logger_mutex_lock);
+#if KD_TREE_STATS
+            logger_max_depth = max(logger_max_depth, int(Rebuild_Logger.size()));
+#endif
+            while (!Rebuild_Logger.empty()){
+                Operation = Rebuild_Logger.front();
+                Rebuild_Logger.pop();
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);                  
+                run_operation(&new_root_node, Operation);                                       
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);               
+            }   
+            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
             /* Replace to original tree*/          
-            pthread_mutex_lock(&working_flag_mutex);
+            lock_search_write();
+            lock_working_flag();
             if (Drop_MultiThread_Rebuild){
                 delete_tree_nodes(&new_root_node, NOT_RECORD);
                 rebuild_flag = false;   
                 Rebuild_Ptr = nullptr;
                 Drop_MultiThread_Rebuild = false;
-                delete_tree_nodes(&new_root_node, NOT_RECORD);
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                queue<Operation_Logger_Type> ().swap(Rebuild_Logger);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
                 pthread_mutex_unlock(&working_flag_mutex);
+                pthread_rwlock_unlock(&search_rwlock);
             } else {
-                pthread_mutex_lock(&search_flag_mutex);
-                while (search_mutex_counter != 0){
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    usleep(10);             
-                    pthread_mutex_lock(&search_flag_mutex);
+                // Operations logged after the replay above, the writer is blocked from here on
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+#if KD_TREE_STATS
+                logger_max_depth = max(logger_max_depth, int(Rebuild_Logger.size()));
+#endif
+                while (!Rebuild_Logger.empty()){
+                    run_operation(&new_root_node, Rebuild_Logger.front());
+                    Rebuild_Logger.pop();
                 }
-                search_mutex_counter = -1;
-                pthread_mutex_unlock(&search_flag_mutex);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                // The subtree root may have been copied away from a snapshot during the rebuild
+                old_root_node = (*Rebuild_Ptr);
                 if (father_ptr->left_son_ptr == *Rebuild_Ptr) {
                     father_ptr->left_son_ptr = new_root_node;
                 } else if (father_ptr->right_son_ptr == *Rebuild_Ptr){             
@@ -251,24 +518,37 @@ void KD_TREE::multi_thread_rebuild(){
                 }
                 if (new_root_node != nullptr) new_root_node->father_ptr = father_ptr;
                 (*Rebuild_Ptr) = new_root_node;                 
+                Update_Son_Range(father_ptr);
                 if (father_ptr == STATIC_ROOT_NODE) Root_Node = STATIC_ROOT_NODE->left_son_ptr;             
-                pthread_mutex_lock(&search_flag_mutex);
-                search_mutex_counter = 0;
-                pthread_mutex_unlock(&search_flag_mutex);
                 Rebuild_Ptr = nullptr;
-                pthread_mutex_unlock(&working_flag_mutex);
+                // Cleared under the lock, otherwise the next subtree's operations would be logged for this rebuild
                 rebuild_flag = false;                     
+                pthread_mutex_unlock(&working_flag_mutex);
+                pthread_rwlock_unlock(&search_rwlock);
+#if KD_TREE_STATS
+                rebuild_stats.Record(stats_now_ns() - rebuild_start_ns);
+                rebuild_point_stats.fetch_add(rebuild_point_num, memory_order_relaxed);
+                if (rebuild_point_num > rebuild_max_point_stats.load(memory_order_relaxed)) rebuild_max_point_stats.store(rebuild_point_num);
+#endif
                 /* Delete discarded tree nodes */  
                 delete_tree_nodes(&old_root_node, MULTI_THREAD_REC);
+                Publish_Removed_Points(Multithread_Points_deleted);
             }
         } else {
             pthread_mutex_unlock(&working_flag_mutex);             
         }
+        // Sleep until a subtree is marked for rebuild instead of polling, trees of a forest would keep the cores busy
+        if (Rebuild_Ptr == nullptr){
+            clock_gettime(CLOCK_REALTIME, &timeout);
+            timeout.tv_nsec += Rebuild_Wait_Time * 1000000;
+            timeout.tv_sec += timeout.tv_nsec / 1000000000;
+            timeout.tv_nsec %= 1000000000;
+            pthread_cond_timedwait(&rebuild_signal, &rebuild_ptr_mutex_lock, &timeout);
+        }
         pthread_mutex_unlock(&rebuild_ptr_mutex_lock);         
         pthread_mutex_lock(&termination_flag_mutex_lock);
         terminated = termination_flag;
         pthread_mutex_unlock(&termination_flag_mutex_lock);          
-        usleep(100); 
     }
     printf("Rebuild thread terminated normally\n");    
 }
@@ -291,11 +571,20 @@ void KD_TREE::run_operation(KD_TREE_NODE ** root, Operation_Logger_Type operatio
     case DOWNSAMPLE_DELETE:
         Delete_by_range(root, operation.boxpoint, false, true);
         break;
+    case DELETE_REGION:
+        Delete_by_region(root, operation.region, false);
+        break;
+    case ADD_REGION:
+        Add_by_region(root, operation.region, false);
+        break;
     case PUSH_DOWN:
+        if (*root == nullptr) break;
         (*root)->tree_downsample_deleted |= operation.tree_downsample_deleted;
         (*root)->point_downsample_deleted |= operation.tree_downsample_deleted;
         (*root)->tree_deleted = operation.tree_deleted || (*root)->tree_downsample_deleted;
         (*root)->point_deleted = (*root)->tree_deleted || (*root)->point_downsample_deleted;
+        (*root)->has_downsample_deleted |= operation.tree_downsample_deleted;
+        (*root)->invalid_point_num = (*root)->tree_deleted ? (*root)->TreeSize : 0;
         (*root)->need_push_down_to_left = true;
         (*root)->need_push_down_to_right = true;     
         break;
@@ -305,11 +594,27 @@ void KD_TREE::run_operation(KD_TREE_NODE ** root, Operation_Logger_Type operatio
 }
 
 void KD_TREE::Build(PointVector point_cloud){
+    Wait_For_Async();
+    uint64_t start_ns = Stats_Begin();
+    Trace_Record(TRACE_BUILD, 0, point_cloud.data(), point_cloud.size(), sizeof(PointType));
+    lock_search_write();
+    lock_working_flag();
+    // A running rebuild would swap its result into the discarded tree
+    Cancel_Rebuild();
+    Assign_Point_IDs(point_cloud);
+    Build_Locked(point_cloud);
+    Cache_Rebuild();
+    pthread_mutex_unlock(&working_flag_mutex);
+    pthread_rwlock_unlock(&search_rwlock);
+    Stats_End(STATS_BUILD, start_ns);
+}
+
+void KD_TREE::Build_Locked(PointVector & point_cloud){
     if (Root_Node != nullptr){
         delete_tree_nodes(&Root_Node, NOT_RECORD);
     }
     if (point_cloud.size() == 0) return;
-    STATIC_ROOT_NODE = new KD_TREE_NODE;
+    if (STATIC_ROOT_NODE == nullptr) STATIC_ROOT_NODE = new KD_TREE_NODE;
     InitTreeNode(STATIC_ROOT_NODE); 
     BuildTree(&STATIC_ROOT_NODE->left_son_ptr, 0, point_cloud.size()-1, point_cloud);
     Update(STATIC_ROOT_NODE);
@@ -317,58 +622,279 @@ void KD_TREE::Build(PointVector point_cloud){
     Root_Node = STATIC_ROOT_NODE->left_son_ptr;    
 }
 
+void KD_TREE::Assign_Point_IDs(PointVector & points){
+    for (int i = 0; i < points.size(); i++){
+        if (points[i].id == Invalid_Point_ID) points[i].id = point_id_num++;
+    }
+    return;
+}
+
+uint32_t KD_TREE::next_point_id(){
+    return point_id_num;
+}
+
 void KD_TREE::Nearest_Search(PointType point, int k_nearest, PointVector& Nearest_Points, vector<float> & Point_Distance){   
-    priority_queue<PointType_CMP> q; // Clear the priority queue;
-    PointVector ().swap(Nearest_Points);
-    vector<float> ().swap(Point_Distance);
-    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node){
-        Search(Root_Node, k_nearest, point, q);
-    } else {
-        pthread_mutex_lock(&search_flag_mutex);
-        while (search_mutex_counter == -1)
-        {
-            pthread_mutex_unlock(&search_flag_mutex);
-            usleep(1);
-            pthread_mutex_lock(&search_flag_mutex);
+    Nearest_Search(default_search_context, point, k_nearest, Nearest_Points, Point_Distance);
+    return;
+}
+
+void KD_TREE::Nearest_Search(Nearest_Search_Context & context, PointType point, int k_nearest, PointVector& Nearest_Points, vector<float> & Point_Distance){
+    uint64_t start_ns = Stats_Begin();
+    Trace_Record(TRACE_NEAREST_SEARCH, k_nearest, &point, 1, sizeof(PointType));
+    lock_search_read();
+    Search_Nearest(point, k_nearest, context.heap);
+    pthread_rwlock_unlock(&search_rwlock);
+    Collect_Nearest(context.heap, k_nearest, Nearest_Points, Point_Distance);
+    Stats_End(STATS_NEAREST_SEARCH, start_ns);
+    return;
+}
+
+int KD_TREE::Nearest_Search(Nearest_Search_Context & context, PointType point, int k_nearest, PointType * Nearest_Points, float * Point_Distance){
+    uint64_t start_ns = Stats_Begin();
+    Trace_Record(TRACE_NEAREST_SEARCH, k_nearest, &point, 1, sizeof(PointType));
+    lock_search_read();
+    Search_Nearest(point, k_nearest, context.heap);
+    pthread_rwlock_unlock(&search_rwlock);
+    int k_found = Collect_Nearest(context.heap, k_nearest, Nearest_Points, Point_Distance);
+    Stats_End(STATS_NEAREST_SEARCH, start_ns);
+    return k_found;
+}
+
+void KD_TREE::Search_Nearest(PointType point, int k_nearest, PointType_Heap & q){
+    // Called under the read lock
+    q.clear();
+    if (voxel_cache_size > 0.0f){
+        if (Cache_Search(point, k_nearest, q)){
+#if KD_TREE_STATS
+            voxel_cache_hit_stats.fetch_add(1, memory_order_relaxed);
+#endif
+            return;
         }
-        search_mutex_counter += 1;
-        pthread_mutex_unlock(&search_flag_mutex);  
-        Search(Root_Node, k_nearest, point, q);  
-        pthread_mutex_lock(&search_flag_mutex);
-        search_mutex_counter -= 1;
-        pthread_mutex_unlock(&search_flag_mutex);      
+#if KD_TREE_STATS
+        voxel_cache_miss_stats.fetch_add(1, memory_order_relaxed);
+#endif
+        q.clear();
     }
+    Search(Root_Node, k_nearest, point, q);
+    return;
+}
+
+int KD_TREE::Collect_Nearest(PointType_Heap & q, int k_nearest, PointType * Nearest_Points, float * Point_Distance){
     int k_found = min(k_nearest,int(q.size()));
-    PointVector ().swap(Nearest_Points);
-    vector<float> ().swap(Point_Distance);
-    for (int i=0;i < k_found;i++){
-        Nearest_Points.insert(Nearest_Points.begin(), q.top().point);
-        Point_Distance.insert(Point_Distance.begin(), q.top().dist);
+    // The heap pops the farthest point first, so the arrays are filled from the back
+    for (int i = k_found - 1; i >= 0; i--){
+        Nearest_Points[i] = q.top().point;
+        Point_Distance[i] = q.top().dist;
         q.pop();
     }
+    q.clear();
+    return k_found;
+}
+
+void KD_TREE::Collect_Nearest(PointType_Heap & q, int k_nearest, PointVector &Nearest_Points, vector<float> & Point_Distance){
+    int k_found = min(k_nearest,int(q.size()));
+    Nearest_Points.resize(k_found);
+    Point_Distance.resize(k_found);
+    Collect_Nearest(q, k_nearest, Nearest_Points.data(), Point_Distance.data());
+    return;
+}
+
+void KD_TREE::Nearest_Search_Batch(PointVector & Query_Points, int k_nearest, vector<PointVector> & Nearest_Points, vector<vector<float>> & Point_Distance, bool sort_queries){
+    Nearest_Search_Batch(default_search_context, Query_Points, k_nearest, Nearest_Points, Point_Distance, sort_queries);
+    return;
+}
+
+void KD_TREE::Nearest_Search_Batch(Nearest_Search_Context & context, PointVector & Query_Points, int k_nearest, vector<PointVector> & Nearest_Points, vector<vector<float>> & Point_Distance, bool sort_queries){
+    int query_num = Query_Points.size();
+    Nearest_Points.resize(query_num);
+    Point_Distance.resize(query_num);
+    Batch_Order(context, Query_Points, sort_queries);
+    // Dispatch in curve order and scatter the results back to the original query index
+    for (int i = 0; i < query_num; i++){
+        int index = context.query_order[i];
+        Nearest_Search(context, Query_Points[index], k_nearest, Nearest_Points[index], Point_Distance[index]);
+    }
+    return;
+}
+
+void KD_TREE::Batch_Order(Nearest_Search_Context & context, const PointVector & Query_Points, bool sort_queries){
+    int query_num = Query_Points.size();
+    if (sort_queries){
+        Morton_Order(Query_Points, context.query_order, context.morton_codes);
+    } else {
+        context.query_order.resize(query_num);
+        for (int i = 0; i < query_num; i++) context.query_order[i] = i;
+    }
+    return;
+}
+
+void KD_TREE::Nearest_Plane_Search(PointType point, int k_nearest, Plane_Fit_Type & Plane){
+    Nearest_Plane_Search(default_search_context, point, k_nearest, Plane);
+    return;
+}
+
+void KD_TREE::Nearest_Plane_Search(Nearest_Search_Context & context, PointType point, int k_nearest, Plane_Fit_Type & Plane){
+    // Counted and traced as a nearest search, the fit does not touch the tree
+    uint64_t start_ns = Stats_Begin();
+    Trace_Record(TRACE_NEAREST_SEARCH, k_nearest, &point, 1, sizeof(PointType));
+    lock_search_read();
+    Search_Nearest(point, k_nearest, context.heap);
+    pthread_rwlock_unlock(&search_rwlock);
+    Fit_Plane(context.heap.data(), min(k_nearest, int(context.heap.size())), point, Plane);
+    context.heap.clear();
+    Stats_End(STATS_NEAREST_SEARCH, start_ns);
+    return;
+}
+
+void KD_TREE::Nearest_Plane_Search_Batch(PointVector & Query_Points, int k_nearest, vector<Plane_Fit_Type> & Planes, bool sort_queries){
+    Nearest_Plane_Search_Batch(default_search_context, Query_Points, k_nearest, Planes, sort_queries);
+    return;
+}
+
+void KD_TREE::Nearest_Plane_Search_Batch(Nearest_Search_Context & context, PointVector & Query_Points, int k_nearest, vector<Plane_Fit_Type> & Planes, bool sort_queries){
+    int query_num = Query_Points.size();
+    Planes.resize(query_num);
+    Batch_Order(context, Query_Points, sort_queries);
+    for (int i = 0; i < query_num; i++){
+        int index = context.query_order[i];
+        Nearest_Plane_Search(context, Query_Points[index], k_nearest, Planes[index]);
+    }
+    return;
+}
+
+static inline PointType transform_point(const Rigid_Transform_Type & transform, const PointType & point){
+    PointType world_point = point;
+    world_point.x = transform.rotation[0][0] * point.x + transform.rotation[0][1] * point.y + transform.rotation[0][2] * point.z + transform.translation[0];
+    world_point.y = transform.rotation[1][0] * point.x + transform.rotation[1][1] * point.y + transform.rotation[1][2] * point.z + transform.translation[1];
+    world_point.z = transform.rotation[2][0] * point.x + transform.rotation[2][1] * point.y + transform.rotation[2][2] * point.z + transform.translation[2];
+    return world_point;
+}
+
+void KD_TREE::Nearest_Search_Batch(const PointVector & Body_Points, const Rigid_Transform_Type & transform, int k_nearest, vector<PointVector> & Nearest_Points, vector<vector<float>> & Point_Distance, bool sort_queries){
+    Nearest_Search_Batch(default_search_context, Body_Points, transform, k_nearest, Nearest_Points, Point_Distance, sort_queries);
+    return;
+}
+
+void KD_TREE::Nearest_Search_Batch(Nearest_Search_Context & context, const PointVector & Body_Points, const Rigid_Transform_Type & transform, int k_nearest, vector<PointVector> & Nearest_Points, vector<vector<float>> & Point_Distance, bool sort_queries){
+    int query_num = Body_Points.size();
+    Nearest_Points.resize(query_num);
+    Point_Distance.resize(query_num);
+    Batch_Order(context, Body_Points, sort_queries);
+    for (int i = 0; i < query_num; i++){
+        int index = context.query_order[i];
+        Nearest_Search(context, transform_point(transform, Body_Points[index]), k_nearest, Nearest_Points[index], Point_Distance[index]);
+    }
+    return;
+}
+
+void KD_TREE::Nearest_Plane_Search_Batch(const PointVector & Body_Points, const Rigid_Transform_Type & transform, int k_nearest, vector<Plane_Fit_Type> & Planes, bool sort_queries){
+    Nearest_Plane_Search_Batch(default_search_context, Body_Points, transform, k_nearest, Planes, sort_queries);
+    return;
+}
+
+void KD_TREE::Nearest_Plane_Search_Batch(Nearest_Search_Context & context, const PointVector & Body_Points, const Rigid_Transform_Type & transform, int k_nearest, vector<Plane_Fit_Type> & Planes, bool sort_queries){
+    int query_num = Body_Points.size();
+    Planes.resize(query_num);
+    Batch_Order(context, Body_Points, sort_queries);
+    for (int i = 0; i < query_num; i++){
+        int index = context.query_order[i];
+        Nearest_Plane_Search(context, transform_point(transform, Body_Points[index]), k_nearest, Planes[index]);
+    }
+    return;
+}
+
+void KD_TREE::Box_Search(BoxPointType box, PointVector & Storage){
+    uint64_t start_ns = Stats_Begin();
+    Trace_Record(TRACE_BOX_SEARCH, 0, &box, 1, sizeof(BoxPointType));
+    Storage.clear();
+    lock_search_read();
+    Search_by_range(Root_Node, box, Storage);
+    pthread_rwlock_unlock(&search_rwlock);
+    Stats_End(STATS_BOX_SEARCH, start_ns);
+    return;
+}
+
+void KD_TREE::Box_Search(BoxPointType box, const Point_Visitor & visitor){
+    uint64_t start_ns = Stats_Begin();
+    Trace_Record(TRACE_BOX_SEARCH, 0, &box, 1, sizeof(BoxPointType));
+    lock_search_read();
+    Visit_by_range(Root_Node, box, visitor);
+    pthread_rwlock_unlock(&search_rwlock);
+    Stats_End(STATS_BOX_SEARCH, start_ns);
+    return;
+}
+
+int KD_TREE::Box_Search(BoxPointType box, PointType * output, int capacity){
+    uint64_t start_ns = Stats_Begin();
+    Trace_Record(TRACE_BOX_SEARCH, 0, &box, 1, sizeof(BoxPointType));
+    int point_num = 0;
+    auto visitor = [output, capacity, &point_num](const PointType & point){
+        if (point_num < capacity) output[point_num] = point;
+        point_num++;
+    };
+    lock_search_read();
+    Visit_by_range(Root_Node, box, visitor);
+    pthread_rwlock_unlock(&search_rwlock);
+    Stats_End(STATS_BOX_SEARCH, start_ns);
+    return point_num;
+}
+
+void KD_TREE::Box_Search_Parallel(BoxPointType box, int thread_num, const Parallel_Point_Visitor & visitor){
+    uint64_t start_ns = Stats_Begin();
+    Trace_Record(TRACE_BOX_SEARCH_PARALLEL, thread_num, &box, 1, sizeof(BoxPointType));
+    Range_Search_Context context;
+    context.tree = this;
+    context.box = box;
+    context.visitor = &visitor;
+    int split_depth = 0;
+    while ((1 << split_depth) < thread_num * Range_Search_Task_Num) split_depth++;
+    // The workers search under the read lock held by this thread
+    lock_search_read();
+    Split_by_range(Root_Node, context.box, split_depth, context);
+    thread_num = max(1, min(thread_num, int(context.tasks.size())));
+    vector<pthread_t> threads(thread_num);
+    vector<Range_Thread_Arg> thread_args(thread_num);
+    for (int i = 0; i < thread_num; i++){
+        thread_args[i].context = &context;
+        thread_args[i].thread_index = i;
+    }
+    for (int i = 1; i < thread_num; i++) pthread_create(&threads[i], NULL, range_thread_ptr, (void*) &thread_args[i]);
+    Range_Task_Loop(context, 0);
+    for (int i = 1; i < thread_num; i++) pthread_join(threads[i], NULL);
+    pthread_rwlock_unlock(&search_rwlock);
+    Stats_End(STATS_BOX_SEARCH, start_ns);
     return;
 }
 
 void KD_TREE::Add_Points(PointVector & PointToAdd, bool downsample_on){
+    Wait_For_Async();
+    uint64_t start_ns = Stats_Begin();
+    Trace_Record(TRACE_ADD_POINTS, downsample_on, PointToAdd.data(), PointToAdd.size(), sizeof(PointType));
     int NewPointSize = PointToAdd.size();
     int tree_size = size();
+    Assign_Point_IDs(PointToAdd);
+    bool downsample_switch = downsample_on && DOWNSAMPLE_SWITCH;
     if (tree_size>0 && NewPointSize > Multi_Thread_Rebuild_Point_Num && float(NewPointSize)/float(tree_size) > ForceRebuildPercentage){
-        pthread_mutex_lock(&working_flag_mutex);
-        Drop_MultiThread_Rebuild = true;
-        Rebuild_Ptr = nullptr;
-        PointVector ().swap(PCL_Storage);        
-        queue<Operation_Logger_Type> ().swap(Rebuild_Logger);
-        flatten(Root_Node, PCL_Storage);
-        PCL_Storage.insert(PCL_Storage.end(), PointToAdd.begin(),PointToAdd.end());
-        Build(PCL_Storage);
+        lock_search_write();
+        lock_working_flag();
+        Cancel_Rebuild();
+        // The batch is split down the tree in place, only the subtrees it would unbalance are rebuilt
+        Add_Batch(&Root_Node, PointToAdd, 0, NewPointSize-1);
+        STATIC_ROOT_NODE->left_son_ptr = Root_Node;
+        Root_Node->father_ptr = STATIC_ROOT_NODE;
+        PointVector ().swap(PCL_Storage);
+        for (int i = 0; i < NewPointSize; i++) Cache_Add_Point(PointToAdd[i]);
         pthread_mutex_unlock(&working_flag_mutex);
+        pthread_rwlock_unlock(&search_rwlock);
+        Stats_End(STATS_ADD_POINTS, start_ns);
         return;
     }
     BoxPointType Box_of_Point;
     PointType downsample_result, mid_point;
-    bool downsample_switch = downsample_on && DOWNSAMPLE_SWITCH;
     float min_dist, tmp_dist;
     for (int i=0; i<PointToAdd.size();i++){
+        // Searches may run between two insertions
+        lock_search_write();
         if (downsample_switch){
             Box_of_Point.vertex_min[0] = floor(PointToAdd[i].x/downsample_size)*downsample_size;
             Box_of_Point.vertex_max[0] = Box_of_Point.vertex_min[0]+downsample_size;
@@ -394,6 +920,8 @@ void KD_TREE::Add_Points(PointVector & PointToAdd, bool downsample_on){
                 if (Downsample_Storage.size() > 1 || same_point(PointToAdd[i], downsample_result)){
                     Delete_by_range(&Root_Node, Box_of_Point, true, true);     
                     Add_by_point(&Root_Node, downsample_result, true);                      
+                    Cache_Delete_Box(Box_of_Point);
+                    Cache_Add_Point(downsample_result);
                 }
             } else {
                 if (Downsample_Storage.size() > 1 || same_point(PointToAdd[i], downsample_result)){
@@ -402,9 +930,11 @@ void KD_TREE::Add_Points(PointVector & PointToAdd, bool downsample_on){
                     operation_delete.op = DOWNSAMPLE_DELETE;
                     operation.point = downsample_result;
                     operation.op = ADD_POINT;
-                    pthread_mutex_lock(&working_flag_mutex);
+                    lock_working_flag();
                     Delete_by_range(&Root_Node, Box_of_Point, false , true);                 
                     Add_by_point(&Root_Node, downsample_result, false);
+                    Cache_Delete_Box(Box_of_Point);
+                    Cache_Add_Point(downsample_result);
                     if (rebuild_flag){
                         pthread_mutex_lock(&rebuild_logger_mutex_lock);
                         Rebuild_Logger.push(operation_delete);
@@ -421,7 +951,7 @@ void KD_TREE::Add_Points(PointVector & PointToAdd, bool downsample_on){
                 Operation_Logger_Type operation;
                 operation.point = PointToAdd[i];
                 operation.op = ADD_POINT;                
-                pthread_mutex_lock(&working_flag_mutex);
+                lock_working_flag();
                 Add_by_point(&Root_Node, PointToAdd[i], false);
                 if (rebuild_flag){
                     pthread_mutex_lock(&rebuild_logger_mutex_lock);
@@ -430,41 +960,51 @@ void KD_TREE::Add_Points(PointVector & PointToAdd, bool downsample_on){
                 }
                 pthread_mutex_unlock(&working_flag_mutex);       
             }
+            Cache_Add_Point(PointToAdd[i]);
         }
+        pthread_rwlock_unlock(&search_rwlock);
     }
+    Stats_End(STATS_ADD_POINTS, start_ns);
     return;
 }
 
-void KD_TREE::Add_Point_Boxes(vector<BoxPointType> & BoxPoints){     
+int KD_TREE::Add_Point_Boxes(vector<BoxPointType> & BoxPoints, PointVector * Revived_Points){     
+    Wait_For_Async();
+    uint64_t start_ns = Stats_Begin();
+    Trace_Record(TRACE_ADD_BOXES, 0, BoxPoints.data(), BoxPoints.size(), sizeof(BoxPointType));
+    int revived_num = 0;
     for (int i=0;i < BoxPoints.size();i++){
+        int box_revived_num = 0;
+        lock_search_write();
         if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node){
-            Add_by_range(&Root_Node ,BoxPoints[i], true);
+            box_revived_num = Add_by_range(&Root_Node ,BoxPoints[i], true, Revived_Points);
         } else {
-            Operation_Logger_Type operation;
-            operation.boxpoint = BoxPoints[i];
-            operation.op = ADD_BOX;
-            pthread_mutex_lock(&working_flag_mutex);
-            Add_by_range(&Root_Node ,BoxPoints[i], false);
-            if (rebuild_flag){
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(operation);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
-            }               
+            lock_working_flag();
+            box_revived_num = Add_by_range(&Root_Node ,BoxPoints[i], false, Revived_Points);
+            if (rebuild_flag && box_revived_num > 0) Drop_MultiThread_Rebuild = true;
             pthread_mutex_unlock(&working_flag_mutex);
         }    
+        if (box_revived_num > 0) Cache_Refresh_Box(BoxPoints[i]);
+        pthread_rwlock_unlock(&search_rwlock);
+        revived_num += box_revived_num;
     } 
-    return;
+    Stats_End(STATS_ADD_BOXES, start_ns);
+    return revived_num;
 }
 
 void KD_TREE::Delete_Points(PointVector & PointToDel){        
+    Wait_For_Async();
+    uint64_t start_ns = Stats_Begin();
+    Trace_Record(TRACE_DELETE_POINTS, 0, PointToDel.data(), PointToDel.size(), sizeof(PointType));
     for (int i=0;i<PointToDel.size();i++){
+        lock_search_write();
         if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node){               
             Delete_by_point(&Root_Node, PointToDel[i], true);
         } else {
             Operation_Logger_Type operation;
             operation.point = PointToDel[i];
             operation.op = DELETE_POINT;
-            pthread_mutex_lock(&working_flag_mutex);        
+            lock_working_flag();        
             Delete_by_point(&Root_Node, PointToDel[i], false);
             if (rebuild_flag){
                 pthread_mutex_lock(&rebuild_logger_mutex_lock);
@@ -473,19 +1013,26 @@ void KD_TREE::Delete_Points(PointVector & PointToDel){
             }
             pthread_mutex_unlock(&working_flag_mutex);
         }      
+        Cache_Delete_Point(PointToDel[i]);
+        pthread_rwlock_unlock(&search_rwlock);
     }      
+    Stats_End(STATS_DELETE_POINTS, start_ns);
     return;
 }
 
 void KD_TREE::Delete_Point_Boxes(vector<BoxPointType> & BoxPoints){      
+    Wait_For_Async();
+    uint64_t start_ns = Stats_Begin();
+    Trace_Record(TRACE_DELETE_BOXES, 0, BoxPoints.data(), BoxPoints.size(), sizeof(BoxPointType));
     for (int i=0;i < BoxPoints.size();i++){ 
+        lock_search_write();
         if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node){               
             Delete_by_range(&Root_Node ,BoxPoints[i], true, false);
         } else {
             Operation_Logger_Type operation;
             operation.boxpoint = BoxPoints[i];
             operation.op = DELETE_BOX;     
-            pthread_mutex_lock(&working_flag_mutex); 
+            lock_working_flag(); 
             Delete_by_range(&Root_Node ,BoxPoints[i], false, false);
             if (rebuild_flag){
                 pthread_mutex_lock(&rebuild_logger_mutex_lock);
@@ -494,105 +1041,643 @@ void KD_TREE::Delete_Point_Boxes(vector<BoxPointType> & BoxPoints){
             }                
             pthread_mutex_unlock(&working_flag_mutex);
         }
+        Cache_Delete_Box(BoxPoints[i]);
+        pthread_rwlock_unlock(&search_rwlock);
     } 
+    Stats_End(STATS_DELETE_BOXES, start_ns);
     return;
 }
 
-void KD_TREE::acquire_removed_points(PointVector & removed_points){
-    pthread_mutex_lock(&points_deleted_rebuild_mutex_lock); 
-    for (int i = 0; i < Points_deleted.size();i++){
-        removed_points.push_back(Points_deleted[i]);
+int KD_TREE::Add_Point_Regions(vector<RegionType> & Regions, PointVector * Revived_Points){
+    Wait_For_Async();
+    uint64_t start_ns = Stats_Begin();
+    Trace_Record(TRACE_ADD_REGIONS, 0, Regions.data(), Regions.size(), sizeof(RegionType));
+    int revived_num = 0;
+    for (int i=0;i < Regions.size();i++){
+        int region_revived_num = 0;
+        lock_search_write();
+        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node){
+            region_revived_num = Add_by_region(&Root_Node, Regions[i], true, Revived_Points);
+        } else {
+            lock_working_flag();
+            region_revived_num = Add_by_region(&Root_Node, Regions[i], false, Revived_Points);
+            if (rebuild_flag && region_revived_num > 0) Drop_MultiThread_Rebuild = true;
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+        if (region_revived_num > 0) Cache_Refresh_Box(Regions[i].bound);
+        pthread_rwlock_unlock(&search_rwlock);
+        revived_num += region_revived_num;
     }
-    for (int i = 0; i < Multithread_Points_deleted.size();i++){
-        removed_points.push_back(Multithread_Points_deleted[i]);
+    Stats_End(STATS_ADD_REGIONS, start_ns);
+    return revived_num;
+}
+
+void KD_TREE::Delete_Point_Regions(vector<RegionType> & Regions){
+    Wait_For_Async();
+    uint64_t start_ns = Stats_Begin();
+    Trace_Record(TRACE_DELETE_REGIONS, 0, Regions.data(), Regions.size(), sizeof(RegionType));
+    for (int i=0;i < Regions.size();i++){
+        lock_search_write();
+        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node){
+            Delete_by_region(&Root_Node, Regions[i], true);
+        } else {
+            Operation_Logger_Type operation;
+            operation.region = Regions[i];
+            operation.op = DELETE_REGION;
+            lock_working_flag();
+            Delete_by_region(&Root_Node, Regions[i], false);
+            if (rebuild_flag){
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                Rebuild_Logger.push(operation);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            }
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+        Cache_Refresh_Box(Regions[i].bound);
+        pthread_rwlock_unlock(&search_rwlock);
     }
-    Points_deleted.clear();
-    Multithread_Points_deleted.clear();
-    pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);   
+    Stats_End(STATS_DELETE_REGIONS, start_ns);
     return;
 }
 
-void KD_TREE::BuildTree(KD_TREE_NODE ** root, int l, int r, PointVector & Storage){
-    if (l>r) return;
-    *root = new KD_TREE_NODE;
-    InitTreeNode(*root);
-    int mid = (l+r)>>1; 
-    // Find the best division Axis
-    int i;
-    float average[3] = {0,0,0};
-    float covariance[3] = {0,0,0};
-    for (i=l;i<=r;i++){
-        average[0] += Storage[i].x;
-        average[1] += Storage[i].y;
-        average[2] += Storage[i].z;
-    }
-    for (i=0;i<3;i++) average[i] = average[i]/(r-l+1);
-    for (i=l;i<=r;i++){
-        covariance[0] += (Storage[i].x - average[0]) * (Storage[i].x - average[0]);
-        covariance[1] += (Storage[i].y - average[1]) * (Storage[i].y - average[1]);  
-        covariance[2] += (Storage[i].z - average[2]) * (Storage[i].z - average[2]);              
-    }
-    for (i=0;i<3;i++) covariance[i] = covariance[i]/(r-l+1);    
-    int div_axis = 0;
-    for (i = 1;i<3;i++){
-        if (covariance[i] > covariance[div_axis]) div_axis = i;
-    }
-    (*root)->division_axis = div_axis;
-    switch (div_axis)
-    {
-    case 0:
-        nth_element(begin(Storage)+l, begin(Storage)+mid, begin(Storage)+r+1, point_cmp_x);
-        break;
-    case 1:
-        nth_element(begin(Storage)+l, begin(Storage)+mid, begin(Storage)+r+1, point_cmp_y);
-        break;
-    case 2:
-        nth_element(begin(Storage)+l, begin(Storage)+mid, begin(Storage)+r+1, point_cmp_z);
-        break;
-    default:
-        nth_element(begin(Storage)+l, begin(Storage)+mid, begin(Storage)+r+1, point_cmp_x);
-        break;
-    }  
-    (*root)->point = Storage[mid]; 
-    KD_TREE_NODE * left_son = nullptr, * right_son = nullptr;
-    BuildTree(&left_son, l, mid-1, Storage);
-    BuildTree(&right_son, mid+1, r, Storage);  
-    (*root)->left_son_ptr = left_son;
-    (*root)->right_son_ptr = right_son;
-    Update((*root));  
+void KD_TREE::Region_Search(const RegionType & region, PointVector & Storage){
+    uint64_t start_ns = Stats_Begin();
+    Trace_Record(TRACE_REGION_SEARCH, 0, &region, 1, sizeof(RegionType));
+    Storage.clear();
+    auto visitor = [&Storage](const PointType & point){
+        Storage.push_back(point);
+    };
+    lock_search_read();
+    Visit_by_region(Root_Node, region, visitor);
+    pthread_rwlock_unlock(&search_rwlock);
+    Stats_End(STATS_REGION_SEARCH, start_ns);
     return;
 }
 
-void KD_TREE::Rebuild(KD_TREE_NODE ** root){    
-    KD_TREE_NODE * father_ptr;
-    if ((*root)->TreeSize >= Multi_Thread_Rebuild_Point_Num) { 
-        max_need_rebuild_num = max((*root)->TreeSize,max_need_rebuild_num);
-        if (!pthread_mutex_trylock(&rebuild_ptr_mutex_lock)){     
-            if (Rebuild_Ptr == nullptr || ((*root)->TreeSize > (*Rebuild_Ptr)->TreeSize)) {
-                Rebuild_Ptr = root;          
-            }
-            pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
-        }
-    } else {
-        father_ptr = (*root)->father_ptr;
-        rebuild_counter += (*root)->TreeSize;
-        int size_rec = (*root)->TreeSize;
-        PCL_Storage.clear();
-        flatten(*root, PCL_Storage);       
-        delete_tree_nodes(root, DELETE_POINTS_REC);
-        BuildTree(root, 0, PCL_Storage.size()-1, PCL_Storage);
-        if (*root != nullptr) (*root)->father_ptr = father_ptr;
-        if (*root == Root_Node) STATIC_ROOT_NODE->left_son_ptr = *root;
-    } 
+void KD_TREE::Region_Search(const RegionType & region, const Point_Visitor & visitor){
+    uint64_t start_ns = Stats_Begin();
+    Trace_Record(TRACE_REGION_SEARCH, 0, &region, 1, sizeof(RegionType));
+    lock_search_read();
+    Visit_by_region(Root_Node, region, visitor);
+    pthread_rwlock_unlock(&search_rwlock);
+    Stats_End(STATS_REGION_SEARCH, start_ns);
     return;
 }
 
-void KD_TREE::Delete_by_range(KD_TREE_NODE ** root,  BoxPointType boxpoint, bool allow_rebuild, bool is_downsample){   
-    if ((*root) == nullptr || (*root)->tree_deleted) return;
-    Push_Down(*root);     
+void KD_TREE::Export_Points(PointVector & Storage){
+    Storage.clear();
+    lock_search_read();
+    flatten(Root_Node, Storage);
+    pthread_rwlock_unlock(&search_rwlock);
+    return;
+}
+
+void KD_TREE::acquire_removed_points(PointVector & removed_points){
+    pthread_mutex_lock(&points_deleted_rebuild_mutex_lock); 
+    if (removed_points.empty()){
+        // The empty vector handed in becomes the next buffer of the tree, so its capacity is reused
+        removed_points.swap(Removed_Points);
+    } else {
+        removed_points.insert(removed_points.end(), Removed_Points.begin(), Removed_Points.end());
+        Removed_Points.clear();
+    }
+    pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);   
+    return;
+}
+
+void KD_TREE::Publish_Removed_Points(PointVector & points){
+    // points is private to the writer or the rebuild thread, it is handed over once per discarded subtree
+    if (points.empty()) return;
+    pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);
+    if (Removed_Points.empty()){
+        Removed_Points.swap(points);
+    } else {
+        Removed_Points.insert(Removed_Points.end(), points.begin(), points.end());
+    }
+    pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);
+    points.clear();
+    return;
+}
+
+shared_ptr<KD_TREE_SNAPSHOT> KD_TREE::Snapshot(){
+    Wait_For_Async();
+    shared_ptr<KD_TREE_SNAPSHOT> snapshot(new KD_TREE_SNAPSHOT);
+    snapshot->tree = this;
+    lock_working_flag();
+    // The rebuild thread would swap its result into a node that is now shared
+    Cancel_Rebuild();
+    snapshot->root = Root_Node;
+    if (Root_Node != nullptr) Root_Node->ref_num++;
+    pthread_mutex_unlock(&working_flag_mutex);
+    return snapshot;
+}
+
+void KD_TREE::Cancel_Rebuild(){
+    // Called with working_flag_mutex held. A running rebuild is dropped when it finishes, a pending one is forgotten
+    if (Rebuild_Ptr != nullptr && rebuild_flag) Drop_MultiThread_Rebuild = true;
+    Rebuild_Ptr = nullptr;
+    pthread_mutex_lock(&rebuild_logger_mutex_lock);
+    queue<Operation_Logger_Type> ().swap(Rebuild_Logger);
+    pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+    return;
+}
+
+/*
+    Asynchronous updates: the caller only queues the batch, async_thread applies the queue in order through
+    the synchronous operations and publishes the sequence of the last update it finished.
+*/
+
+uint64_t KD_TREE::Add_Points_Async(PointVector PointToAdd, bool downsample_on){
+    Async_Operation_Type operation;
+    operation.op = ASYNC_ADD_POINTS;
+    operation.downsample_on = downsample_on;
+    operation.points.swap(PointToAdd);
+    return Enqueue_Async(operation);
+}
+
+uint64_t KD_TREE::Delete_Points_Async(PointVector PointToDel){
+    Async_Operation_Type operation;
+    operation.op = ASYNC_DELETE_POINTS;
+    operation.points.swap(PointToDel);
+    return Enqueue_Async(operation);
+}
+
+uint64_t KD_TREE::Add_Point_Boxes_Async(vector<BoxPointType> BoxPoints){
+    Async_Operation_Type operation;
+    operation.op = ASYNC_ADD_BOXES;
+    operation.boxes.swap(BoxPoints);
+    return Enqueue_Async(operation);
+}
+
+uint64_t KD_TREE::Delete_Point_Boxes_Async(vector<BoxPointType> BoxPoints){
+    Async_Operation_Type operation;
+    operation.op = ASYNC_DELETE_BOXES;
+    operation.boxes.swap(BoxPoints);
+    return Enqueue_Async(operation);
+}
+
+uint64_t KD_TREE::Add_Point_Regions_Async(vector<RegionType> Regions){
+    Async_Operation_Type operation;
+    operation.op = ASYNC_ADD_REGIONS;
+    operation.regions.swap(Regions);
+    return Enqueue_Async(operation);
+}
+
+uint64_t KD_TREE::Delete_Point_Regions_Async(vector<RegionType> Regions){
+    Async_Operation_Type operation;
+    operation.op = ASYNC_DELETE_REGIONS;
+    operation.regions.swap(Regions);
+    return Enqueue_Async(operation);
+}
+
+uint64_t KD_TREE::Enqueue_Async(Async_Operation_Type & operation){
+    pthread_mutex_lock(&async_mutex);
+    if (!async_started){
+        async_started = true;
+        pthread_create(&async_thread, NULL, async_thread_ptr, (void*) this);
+    }
+    operation.sequence = ++async_sequence;
+    uint64_t sequence = operation.sequence;
+    async_queue.push(move(operation));
+    pthread_cond_signal(&async_signal);
+    pthread_mutex_unlock(&async_mutex);
+    return sequence;
+}
+
+uint64_t KD_TREE::Applied_Sequence(){
+    pthread_mutex_lock(&async_mutex);
+    uint64_t sequence = async_applied_sequence;
+    pthread_mutex_unlock(&async_mutex);
+    return sequence;
+}
+
+void KD_TREE::Wait_For_Sequence(uint64_t sequence){
+    pthread_mutex_lock(&async_mutex);
+    // A sequence never queued would never be applied
+    sequence = min(sequence, async_sequence);
+    while (async_applied_sequence < sequence) pthread_cond_wait(&async_applied_signal, &async_mutex);
+    pthread_mutex_unlock(&async_mutex);
+    return;
+}
+
+void KD_TREE::Wait_For_Async(){
+    // Synchronous updates from the caller run once the queue is applied; the async thread itself never waits
+    pthread_mutex_lock(&async_mutex);
+    if (async_started && !pthread_equal(pthread_self(), async_thread)){
+        while (async_applied_sequence < async_sequence) pthread_cond_wait(&async_applied_signal, &async_mutex);
+    }
+    pthread_mutex_unlock(&async_mutex);
+    return;
+}
+
+void * KD_TREE::async_thread_ptr(void * arg){
+    KD_TREE * handle = (KD_TREE *) arg;
+    handle->Async_Loop();
+    return nullptr;
+}
+
+void KD_TREE::Async_Loop(){
+    pthread_mutex_lock(&async_mutex);
+    while (true){
+        if (async_queue.empty()){
+            if (async_termination) break;
+            pthread_cond_wait(&async_signal, &async_mutex);
+            continue;
+        }
+        Async_Operation_Type operation = move(async_queue.front());
+        async_queue.pop();
+        pthread_mutex_unlock(&async_mutex);
+        switch (operation.op){
+            case ASYNC_ADD_POINTS:
+                Add_Points(operation.points, operation.downsample_on);
+                break;
+            case ASYNC_DELETE_POINTS:
+                Delete_Points(operation.points);
+                break;
+            case ASYNC_ADD_BOXES:
+                Add_Point_Boxes(operation.boxes);
+                break;
+            case ASYNC_DELETE_BOXES:
+                Delete_Point_Boxes(operation.boxes);
+                break;
+            case ASYNC_ADD_REGIONS:
+                Add_Point_Regions(operation.regions);
+                break;
+            case ASYNC_DELETE_REGIONS:
+                Delete_Point_Regions(operation.regions);
+                break;
+            default:
+                break;
+        }
+        pthread_mutex_lock(&async_mutex);
+        async_applied_sequence = operation.sequence;
+        pthread_cond_broadcast(&async_applied_signal);
+    }
+    pthread_mutex_unlock(&async_mutex);
+    return;
+}
+
+void KD_TREE::stop_async_thread(){
+    // Queued updates are applied before the thread exits
+    pthread_mutex_lock(&async_mutex);
+    async_termination = true;
+    pthread_cond_signal(&async_signal);
+    pthread_mutex_unlock(&async_mutex);
+    if (async_started) pthread_join(async_thread, NULL);
+    pthread_cond_destroy(&async_signal);
+    pthread_cond_destroy(&async_applied_signal);
+    pthread_mutex_destroy(&async_mutex);
+    return;
+}
+
+/*
+    Voxel cache: a copy of the valid points hashed by voxel, mirrored by the writer under the write lock.
+    Insertions, box deletions and deletions by id are applied to it directly. Deletions by position,
+    region deletions and revivals re-read the voxels they touch from the tree.
+*/
+
+int KD_TREE::voxel_coord(float value){
+    double coord = floor(double(value) / voxel_cache_size);
+    return int(max(-1048576.0, min(1048575.0, coord)));
+}
+
+uint64_t KD_TREE::voxel_key(int ix, int iy, int iz){
+    return (uint64_t((ix + 1048576) & 0x1FFFFF) << 42) | (uint64_t((iy + 1048576) & 0x1FFFFF) << 21) | uint64_t((iz + 1048576) & 0x1FFFFF);
+}
+
+void KD_TREE::Cache_Add_Point(const PointType & point){
+    if (voxel_cache_size <= 0.0f) return;
+    voxel_cache[voxel_key(voxel_coord(point.x), voxel_coord(point.y), voxel_coord(point.z))].push_back(point);
+    return;
+}
+
+void KD_TREE::Cache_Delete_Point(const PointType & point){
+    if (voxel_cache_size <= 0.0f) return;
+    BoxPointType point_box = {{point.x, point.y, point.z}, {point.x, point.y, point.z}};
+    // Which of several points at the same position the tree deleted is only known with an id, otherwise the voxels are read again
+    if (point.id == Invalid_Point_ID){
+        Cache_Refresh_Box(point_box);
+        return;
+    }
+    int lo[3], hi[3];
+    for (int j = 0; j < 3; j++){
+        lo[j] = voxel_coord(point_box.vertex_min[j] - EPSS);
+        hi[j] = voxel_coord(point_box.vertex_max[j] + EPSS);
+    }
+    for (int ix = lo[0]; ix <= hi[0]; ix++){
+        for (int iy = lo[1]; iy <= hi[1]; iy++){
+            for (int iz = lo[2]; iz <= hi[2]; iz++){
+                auto it = voxel_cache.find(voxel_key(ix, iy, iz));
+                if (it == voxel_cache.end()) continue;
+                PointVector & points = it->second;
+                for (int i = 0; i < points.size(); i++){
+                    if (points[i].id != point.id || !same_point(points[i], point)) continue;
+                    points[i] = points.back();
+                    points.pop_back();
+                    if (points.empty()) voxel_cache.erase(it);
+                    return;
+                }
+            }
+        }
+    }
+    return;
+}
+
+void KD_TREE::Cache_Delete_Box(const BoxPointType & box){
+    if (voxel_cache_size <= 0.0f) return;
+    int lo[3], hi[3];
+    for (int j = 0; j < 3; j++){
+        lo[j] = voxel_coord(box.vertex_min[j] - EPSS);
+        hi[j] = voxel_coord(box.vertex_max[j] + EPSS);
+    }
+    // Same test as Delete_by_range
+    auto in_box = [&box](const PointType & point){
+        return box.vertex_min[0]-EPSS < point.x && box.vertex_max[0]+EPSS > point.x && box.vertex_min[1]-EPSS < point.y && box.vertex_max[1]+EPSS > point.y && box.vertex_min[2]-EPSS < point.z && box.vertex_max[2]+EPSS > point.z;
+    };
+    double voxel_num = double(hi[0] - lo[0] + 1) * double(hi[1] - lo[1] + 1) * double(hi[2] - lo[2] + 1);
+    if (voxel_num <= voxel_cache.size()){
+        for (int ix = lo[0]; ix <= hi[0]; ix++){
+            for (int iy = lo[1]; iy <= hi[1]; iy++){
+                for (int iz = lo[2]; iz <= hi[2]; iz++){
+                    auto it = voxel_cache.find(voxel_key(ix, iy, iz));
+                    if (it == voxel_cache.end()) continue;
+                    it->second.erase(remove_if(it->second.begin(), it->second.end(), in_box), it->second.end());
+                    if (it->second.empty()) voxel_cache.erase(it);
+                }
+            }
+        }
+        return;
+    }
+    // The box covers more voxels than the cache holds, so the cache is scanned instead
+    for (auto it = voxel_cache.begin(); it != voxel_cache.end();){
+        it->second.erase(remove_if(it->second.begin(), it->second.end(), in_box), it->second.end());
+        if (it->second.empty()){
+            it = voxel_cache.erase(it);
+        } else {
+            it++;
+        }
+    }
+    return;
+}
+
+void KD_TREE::Cache_Refresh_Voxel(int ix, int iy, int iz){
+    uint64_t key = voxel_key(ix, iy, iz);
+    int index[3] = {ix, iy, iz};
+    BoxPointType box;
+    for (int j = 0; j < 3; j++){
+        box.vertex_min[j] = index[j] * voxel_cache_size - voxel_cache_size * 1e-3f;
+        box.vertex_max[j] = (index[j] + 1) * voxel_cache_size + voxel_cache_size * 1e-3f;
+    }
+    PointVector & points = voxel_cache[key];
+    points.clear();
+    auto visitor = [&](const PointType & point){
+        if (voxel_key(voxel_coord(point.x), voxel_coord(point.y), voxel_coord(point.z)) == key) points.push_back(point);
+    };
+    Visit_by_range(Root_Node, box, visitor);
+    if (points.empty()) voxel_cache.erase(key);
+    return;
+}
+
+void KD_TREE::Cache_Refresh_Box(const BoxPointType & box){
+    if (voxel_cache_size <= 0.0f) return;
+    int lo[3], hi[3];
+    for (int j = 0; j < 3; j++){
+        lo[j] = voxel_coord(box.vertex_min[j] - EPSS);
+        hi[j] = voxel_coord(box.vertex_max[j] + EPSS);
+    }
+    double voxel_num = double(hi[0] - lo[0] + 1) * double(hi[1] - lo[1] + 1) * double(hi[2] - lo[2] + 1);
+    if (voxel_num > max(voxel_cache.size(), size_t(64))){
+        Cache_Rebuild();
+        return;
+    }
+    for (int ix = lo[0]; ix <= hi[0]; ix++){
+        for (int iy = lo[1]; iy <= hi[1]; iy++){
+            for (int iz = lo[2]; iz <= hi[2]; iz++) Cache_Refresh_Voxel(ix, iy, iz);
+        }
+    }
+    return;
+}
+
+void KD_TREE::Cache_Rebuild(){
+    unordered_map<uint64_t, PointVector> ().swap(voxel_cache);
+    if (voxel_cache_size <= 0.0f) return;
+    PointVector points;
+    flatten(Root_Node, points);
+    for (int i = 0; i < points.size(); i++) Cache_Add_Point(points[i]);
+    return;
+}
+
+bool KD_TREE::Cache_Search(PointType point, int k_nearest, PointType_Heap & q){
+    if (k_nearest <= 0) return false;
+    float coord[3] = {point.x, point.y, point.z};
+    int center[3] = {voxel_coord(point.x), voxel_coord(point.y), voxel_coord(point.z)};
+    for (int ring = 0; ring <= voxel_cache_ring; ring++){
+        for (int dx = -ring; dx <= ring; dx++){
+            for (int dy = -ring; dy <= ring; dy++){
+                for (int dz = -ring; dz <= ring; dz++){
+                    // Only the shell of the cube, the inner rings were probed before
+                    if (abs(dx) != ring && abs(dy) != ring && abs(dz) != ring) continue;
+                    int index[3] = {center[0] + dx, center[1] + dy, center[2] + dz};
+                    if (q.size() >= k_nearest){
+                        float voxel_dist = 0.0f;
+                        for (int j = 0; j < 3; j++){
+                            float gap = max(max(index[j] * voxel_cache_size - coord[j], coord[j] - (index[j] + 1) * voxel_cache_size), 0.0f);
+                            voxel_dist += gap * gap;
+                        }
+                        if (voxel_dist >= q.top().dist) continue;
+                    }
+                    auto it = voxel_cache.find(voxel_key(index[0], index[1], index[2]));
+                    if (it == voxel_cache.end()) continue;
+                    const PointVector & points = it->second;
+                    for (int i = 0; i < points.size(); i++){
+                        float dist = calc_dist(point, points[i]);
+                        if (q.size() < k_nearest || dist < q.top().dist){
+                            if (q.size() >= k_nearest) q.pop();
+                            q.push(PointType_CMP(points[i], dist));
+                        }
+                    }
+                }
+            }
+        }
+        if (q.size() < k_nearest) continue;
+        // Every point outside the probed cube is at least as far as its nearest face
+        float bound = FLT_MAX;
+        for (int j = 0; j < 3; j++){
+            bound = min(bound, min(coord[j] - (center[j] - ring) * voxel_cache_size, (center[j] + ring + 1) * voxel_cache_size - coord[j]));
+        }
+        bound *= 1.0f - 1e-5f;
+        if (bound > 0.0f && q.top().dist <= bound * bound) return true;
+    }
+    return false;
+}
+
+KD_TREE_NODE * KD_TREE::New_Tree_Node(KD_TREE_NODE_BLOCK * block){
+    if (block == nullptr || block->used_num >= block->node_num) return new KD_TREE_NODE;
+    KD_TREE_NODE * node = &block->nodes[block->used_num++];
+    node->block_ptr = block;
+    return node;
+}
+
+void KD_TREE::Free_Tree_Node(KD_TREE_NODE * node){
+    KD_TREE_NODE_BLOCK * block = node->block_ptr;
+    if (block == nullptr){
+        delete node;
+        return;
+    }
+    // The block is released with its last living node
+    if (block->alive_num.fetch_sub(1) == 1){
+        delete [] block->nodes;
+        delete block;
+    }
+    return;
+}
+
+void KD_TREE::Release_Node(KD_TREE_NODE * node){
+    if (node == nullptr || --node->ref_num > 0) return;
+    Release_Node(node->left_son_ptr);
+    Release_Node(node->right_son_ptr);
+    Free_Tree_Node(node);
+    return;
+}
+
+void KD_TREE::Make_Writable(KD_TREE_NODE ** root){
+    KD_TREE_NODE * node = *root;
+    if (node == nullptr || node->ref_num == 1) return;
+    // Path copying: the copy takes over this tree's reference, the snapshots keep the original
+    KD_TREE_NODE * new_node = New_Tree_Node(nullptr);
+    new_node->point = node->point;
+    new_node->TreeSize = node->TreeSize;
+    new_node->invalid_point_num = node->invalid_point_num;
+    new_node->division_axis = node->division_axis;
+    new_node->point_deleted = node->point_deleted;
+    new_node->tree_deleted = node->tree_deleted;
+    new_node->point_downsample_deleted = node->point_downsample_deleted;
+    new_node->tree_downsample_deleted = node->tree_downsample_deleted;
+    new_node->has_downsample_deleted = node->has_downsample_deleted;
+    new_node->need_push_down_to_left = node->need_push_down_to_left;
+    new_node->need_push_down_to_right = node->need_push_down_to_right;
+    memcpy(new_node->node_range_x, node->node_range_x, sizeof(node->node_range_x));
+    memcpy(new_node->node_range_y, node->node_range_y, sizeof(node->node_range_y));
+    memcpy(new_node->node_range_z, node->node_range_z, sizeof(node->node_range_z));
+    memcpy(new_node->son_range, node->son_range, sizeof(node->son_range));
+    new_node->left_son_ptr = node->left_son_ptr;
+    new_node->right_son_ptr = node->right_son_ptr;
+    new_node->father_ptr = node->father_ptr;
+    // father_ptr is only followed by the writer and the rebuild thread, so the live tree owns it in shared sons
+    if (new_node->left_son_ptr != nullptr){
+        new_node->left_son_ptr->ref_num++;
+        new_node->left_son_ptr->father_ptr = new_node;
+    }
+    if (new_node->right_son_ptr != nullptr){
+        new_node->right_son_ptr->ref_num++;
+        new_node->right_son_ptr->father_ptr = new_node;
+    }
+    *root = new_node;
+    if (STATIC_ROOT_NODE != nullptr && STATIC_ROOT_NODE->left_son_ptr == node){
+        STATIC_ROOT_NODE->left_son_ptr = new_node;
+        Root_Node = new_node;
+    }
+    Release_Node(node);
+    return;
+}
+
+void KD_TREE::BuildTree(KD_TREE_NODE ** root, int l, int r, PointVector & Storage, KD_TREE_NODE_BLOCK * block){
+    if (l>r) return;
+    // Nodes are taken from the block in pre-order, so each small subtree is contiguous in DFS order
+    if (block == nullptr && r-l+1 <= Node_Block_Size){
+        block = new KD_TREE_NODE_BLOCK;
+        block->node_num = r-l+1;
+        block->used_num = 0;
+        block->alive_num = r-l+1;
+        block->nodes = new KD_TREE_NODE[r-l+1];
+    }
+    *root = New_Tree_Node(block);
+    InitTreeNode(*root);
+    int mid = (l+r)>>1; 
+    // Find the best division Axis
+    int i;
+    float average[3] = {0,0,0};
+    float covariance[3] = {0,0,0};
+    for (i=l;i<=r;i++){
+        average[0] += Storage[i].x;
+        average[1] += Storage[i].y;
+        average[2] += Storage[i].z;
+    }
+    for (i=0;i<3;i++) average[i] = average[i]/(r-l+1);
+    for (i=l;i<=r;i++){
+        covariance[0] += (Storage[i].x - average[0]) * (Storage[i].x - average[0]);
+        covariance[1] += (Storage[i].y - average[1]) * (Storage[i].y - average[1]);  
+        covariance[2] += (Storage[i].z - average[2]) * (Storage[i].z - average[2]);              
+    }
+    for (i=0;i<3;i++) covariance[i] = covariance[i]/(r-l+1);    
+    int div_axis = 0;
+    for (i = 1;i<3;i++){
+        if (covariance[i] > covariance[div_axis]) div_axis = i;
+    }
+    (*root)->division_axis = div_axis;
+    switch (div_axis)
+    {
+    case 0:
+        nth_element(begin(Storage)+l, begin(Storage)+mid, begin(Storage)+r+1, point_cmp_x);
+        break;
+    case 1:
+        nth_element(begin(Storage)+l, begin(Storage)+mid, begin(Storage)+r+1, point_cmp_y);
+        break;
+    case 2:
+        nth_element(begin(Storage)+l, begin(Storage)+mid, begin(Storage)+r+1, point_cmp_z);
+        break;
+    default:
+        nth_element(begin(Storage)+l, begin(Storage)+mid, begin(Storage)+r+1, point_cmp_x);
+        break;
+    }  
+    (*root)->point = Storage[mid]; 
+    KD_TREE_NODE * left_son = nullptr, * right_son = nullptr;
+    BuildTree(&left_son, l, mid-1, Storage, block);
+    BuildTree(&right_son, mid+1, r, Storage, block);  
+    (*root)->left_son_ptr = left_son;
+    (*root)->right_son_ptr = right_son;
+    Update((*root));  
+    return;
+}
+
+void KD_TREE::Rebuild(KD_TREE_NODE ** root){    
+    KD_TREE_NODE * father_ptr;
+    if ((*root)->TreeSize >= Multi_Thread_Rebuild_Point_Num) { 
+        max_need_rebuild_num = max((*root)->TreeSize,max_need_rebuild_num);
+        if (!pthread_mutex_trylock(&rebuild_ptr_mutex_lock)){     
+            if (Rebuild_Ptr == nullptr || ((*root)->TreeSize > (*Rebuild_Ptr)->TreeSize)) {
+                Rebuild_Ptr = root;          
+                pthread_cond_signal(&rebuild_signal);
+            }
+            pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+        }
+    } else {
+        father_ptr = (*root)->father_ptr;
+        rebuild_counter += (*root)->TreeSize;
+#if KD_TREE_STATS
+        writer_rebuild_stats.fetch_add(1, memory_order_relaxed);
+        writer_rebuild_point_stats.fetch_add((*root)->TreeSize, memory_order_relaxed);
+#endif
+        int size_rec = (*root)->TreeSize;
+        PCL_Storage.clear();
+        flatten(*root, PCL_Storage);       
+        delete_tree_nodes(root, DELETE_POINTS_REC);
+        Publish_Removed_Points(Points_deleted);
+        BuildTree(root, 0, PCL_Storage.size()-1, PCL_Storage);
+        if (*root != nullptr) (*root)->father_ptr = father_ptr;
+        if (*root == Root_Node) STATIC_ROOT_NODE->left_son_ptr = *root;
+    } 
+    return;
+}
+
+void KD_TREE::Delete_by_range(KD_TREE_NODE ** root,  BoxPointType boxpoint, bool allow_rebuild, bool is_downsample){   
+    if ((*root) == nullptr || (*root)->tree_deleted) return;
+    // Tested before Make_Writable, so nodes outside the box are not copied away from a snapshot
     if (boxpoint.vertex_max[0] + EPSS < (*root)->node_range_x[0] || boxpoint.vertex_min[0] - EPSS > (*root)->node_range_x[1]) return;
     if (boxpoint.vertex_max[1] + EPSS < (*root)->node_range_y[0] || boxpoint.vertex_min[1] - EPSS > (*root)->node_range_y[1]) return;
     if (boxpoint.vertex_max[2] + EPSS < (*root)->node_range_z[0] || boxpoint.vertex_min[2] - EPSS > (*root)->node_range_z[1]) return;
+    Make_Writable(root);
+    Push_Down(*root);     
     if (boxpoint.vertex_min[0] - EPSS < (*root)->node_range_x[0] && boxpoint.vertex_max[0]+EPSS > (*root)->node_range_x[1] && boxpoint.vertex_min[1]-EPSS < (*root)->node_range_y[0] && boxpoint.vertex_max[1]+EPSS > (*root)->node_range_y[1] && boxpoint.vertex_min[2]-EPSS < (*root)->node_range_z[0] && boxpoint.vertex_max[2]+EPSS > (*root)->node_range_z[1]){
         (*root)->tree_deleted = true;
         (*root)->point_deleted = true;
@@ -602,6 +1687,7 @@ void KD_TREE::Delete_by_range(KD_TREE_NODE ** root,  BoxPointType boxpoint, bool
         if (is_downsample){
             (*root)->tree_downsample_deleted = true;
             (*root)->point_downsample_deleted = true;
+            (*root)->has_downsample_deleted = true;
         }
         return;
     }
@@ -614,29 +1700,33 @@ void KD_TREE::Delete_by_range(KD_TREE_NODE ** root,  BoxPointType boxpoint, bool
     if (is_downsample) delete_box_log.op = DOWNSAMPLE_DELETE;
         else delete_box_log.op = DELETE_BOX;
     delete_box_log.boxpoint = boxpoint;
-    if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr){
-        Delete_by_range(&((*root)->left_son_ptr), boxpoint, allow_rebuild, is_downsample);
-    } else {
-        pthread_mutex_lock(&working_flag_mutex);
-        Delete_by_range(&((*root)->left_son_ptr), boxpoint, false, is_downsample);
-        if (rebuild_flag){
-            pthread_mutex_lock(&rebuild_logger_mutex_lock);
-            Rebuild_Logger.push(delete_box_log);
-            pthread_mutex_unlock(&rebuild_logger_mutex_lock);                 
+    if (son_box_intersect(*root, 0, boxpoint)){
+        if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr){
+            Delete_by_range(&((*root)->left_son_ptr), boxpoint, allow_rebuild, is_downsample);
+        } else {
+            lock_working_flag();
+            Delete_by_range(&((*root)->left_son_ptr), boxpoint, false, is_downsample);
+            if (rebuild_flag){
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                Rebuild_Logger.push(delete_box_log);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);                 
+            }
+            pthread_mutex_unlock(&working_flag_mutex);
         }
-        pthread_mutex_unlock(&working_flag_mutex);
     }
-    if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr){
-        Delete_by_range(&((*root)->right_son_ptr), boxpoint, allow_rebuild, is_downsample);
-    } else {
-        pthread_mutex_lock(&working_flag_mutex);
-        Delete_by_range(&((*root)->right_son_ptr), boxpoint, false, is_downsample);
-        if (rebuild_flag){
-            pthread_mutex_lock(&rebuild_logger_mutex_lock);
-            Rebuild_Logger.push(delete_box_log);
-            pthread_mutex_unlock(&rebuild_logger_mutex_lock);                 
+    if (son_box_intersect(*root, 1, boxpoint)){
+        if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr){
+            Delete_by_range(&((*root)->right_son_ptr), boxpoint, allow_rebuild, is_downsample);
+        } else {
+            lock_working_flag();
+            Delete_by_range(&((*root)->right_son_ptr), boxpoint, false, is_downsample);
+            if (rebuild_flag){
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                Rebuild_Logger.push(delete_box_log);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);                 
+            }
+            pthread_mutex_unlock(&working_flag_mutex);
         }
-        pthread_mutex_unlock(&working_flag_mutex);
     }    
     Update(*root);
     if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num) Rebuild_Ptr = nullptr; 
@@ -645,25 +1735,30 @@ void KD_TREE::Delete_by_range(KD_TREE_NODE ** root,  BoxPointType boxpoint, bool
     return;
 }
 
-void KD_TREE::Delete_by_point(KD_TREE_NODE ** root, PointType point, bool allow_rebuild){   
-    if ((*root) == nullptr || (*root)->tree_deleted) return;
+bool KD_TREE::Delete_by_point(KD_TREE_NODE ** root, PointType point, bool allow_rebuild){   
+    if ((*root) == nullptr || (*root)->tree_deleted) return false;
+    Make_Writable(root);
     Push_Down(*root);
-    if (same_point((*root)->point, point) && !(*root)->point_deleted) {          
+    if (same_point((*root)->point, point) && !(*root)->point_deleted && (point.id == Invalid_Point_ID || point.id == (*root)->point.id)) {          
         (*root)->point_deleted = true;
         (*root)->invalid_point_num += 1;
         if ((*root)->invalid_point_num == (*root)->TreeSize) (*root)->tree_deleted = true;    
-        return;
+        return true;
     }
     Operation_Logger_Type delete_log;
     struct timespec Timeout;    
     delete_log.op = DELETE_POINT;
     delete_log.point = point;     
-    if (((*root)->division_axis == 0 && point.x < (*root)->point.x) || ((*root)->division_axis == 1 && point.y < (*root)->point.y) || ((*root)->division_axis == 2 && point.z < (*root)->point.z)){           
+    bool go_left = ((*root)->division_axis == 0 && point.x < (*root)->point.x) || ((*root)->division_axis == 1 && point.y < (*root)->point.y) || ((*root)->division_axis == 2 && point.z < (*root)->point.z);
+    // A rebuild may leave points equal to the division on both sides, the left one is tried first
+    bool on_division = ((*root)->division_axis == 0 && point.x == (*root)->point.x) || ((*root)->division_axis == 1 && point.y == (*root)->point.y) || ((*root)->division_axis == 2 && point.z == (*root)->point.z);
+    bool deleted = false;
+    if (go_left || on_division){           
         if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr){          
-            Delete_by_point(&(*root)->left_son_ptr, point, allow_rebuild);         
+            deleted = Delete_by_point(&(*root)->left_son_ptr, point, allow_rebuild);         
         } else {
-            pthread_mutex_lock(&working_flag_mutex);
-            Delete_by_point(&(*root)->left_son_ptr, point,false);
+            lock_working_flag();
+            deleted = Delete_by_point(&(*root)->left_son_ptr, point,false);
             if (rebuild_flag){
                 pthread_mutex_lock(&rebuild_logger_mutex_lock);
                 Rebuild_Logger.push(delete_log);
@@ -671,12 +1766,13 @@ void KD_TREE::Delete_by_point(KD_TREE_NODE ** root, PointType point, bool allow_
             }
             pthread_mutex_unlock(&working_flag_mutex);
         }
-    } else {       
+    }
+    if (!go_left && !deleted){       
         if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr){         
-            Delete_by_point(&(*root)->right_son_ptr, point, allow_rebuild);         
+            deleted = Delete_by_point(&(*root)->right_son_ptr, point, allow_rebuild);         
         } else {
-            pthread_mutex_lock(&working_flag_mutex); 
-            Delete_by_point(&(*root)->right_son_ptr, point, false);
+            lock_working_flag(); 
+            deleted = Delete_by_point(&(*root)->right_son_ptr, point, false);
             if (rebuild_flag){
                 pthread_mutex_lock(&rebuild_logger_mutex_lock);
                 Rebuild_Logger.push(delete_log);
@@ -689,51 +1785,105 @@ void KD_TREE::Delete_by_point(KD_TREE_NODE ** root, PointType point, bool allow_
     if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num) Rebuild_Ptr = nullptr; 
     bool need_rebuild = allow_rebuild & Criterion_Check((*root));
     if (need_rebuild) Rebuild(root);
-    return;
+    return deleted;
 }
 
-void KD_TREE::Add_by_range(KD_TREE_NODE ** root, BoxPointType boxpoint, bool allow_rebuild){
-    if ((*root) == nullptr) return;
-    Push_Down(*root);       
-    if (boxpoint.vertex_max[0] + EPSS < (*root)->node_range_x[0] || boxpoint.vertex_min[0] - EPSS > (*root)->node_range_x[1]) return;
-    if (boxpoint.vertex_max[1] + EPSS < (*root)->node_range_y[0] || boxpoint.vertex_min[1] - EPSS > (*root)->node_range_y[1]) return;
-    if (boxpoint.vertex_max[2] + EPSS < (*root)->node_range_z[0] || boxpoint.vertex_min[2] - EPSS > (*root)->node_range_z[1]) return;
-    if (boxpoint.vertex_min[0] - EPSS < (*root)->node_range_x[0] && boxpoint.vertex_max[0]+EPSS > (*root)->node_range_x[1] && boxpoint.vertex_min[1]-EPSS < (*root)->node_range_y[0] && boxpoint.vertex_max[1]+EPSS > (*root)->node_range_y[1] && boxpoint.vertex_min[2]-EPSS < (*root)->node_range_z[0] && boxpoint.vertex_max[2]+EPSS > (*root)->node_range_z[1]){
-        (*root)->tree_deleted = false || (*root)->tree_downsample_deleted;
-        (*root)->point_deleted = false || (*root)->point_downsample_deleted;
+int KD_TREE::Add_by_range(KD_TREE_NODE ** root, BoxPointType boxpoint, bool allow_rebuild, PointVector * Revived){
+    // invalid_point_num is exact, subtrees without deleted points are left untouched
+    if ((*root) == nullptr || (*root)->invalid_point_num == 0) return 0;
+    if (boxpoint.vertex_max[0] + EPSS < (*root)->node_range_x[0] || boxpoint.vertex_min[0] - EPSS > (*root)->node_range_x[1]) return 0;
+    if (boxpoint.vertex_max[1] + EPSS < (*root)->node_range_y[0] || boxpoint.vertex_min[1] - EPSS > (*root)->node_range_y[1]) return 0;
+    if (boxpoint.vertex_max[2] + EPSS < (*root)->node_range_z[0] || boxpoint.vertex_min[2] - EPSS > (*root)->node_range_z[1]) return 0;
+    Make_Writable(root);
+    Push_Down(*root);
+    int revived_num = 0;
+    // The subtree is tagged as a whole only when its revived points are neither listed nor mixed with downsample deleted ones
+    if (Revived == nullptr && !(*root)->has_downsample_deleted && boxpoint.vertex_min[0] - EPSS < (*root)->node_range_x[0] && boxpoint.vertex_max[0]+EPSS > (*root)->node_range_x[1] && boxpoint.vertex_min[1]-EPSS < (*root)->node_range_y[0] && boxpoint.vertex_max[1]+EPSS > (*root)->node_range_y[1] && boxpoint.vertex_min[2]-EPSS < (*root)->node_range_z[0] && boxpoint.vertex_max[2]+EPSS > (*root)->node_range_z[1]){
+        revived_num = (*root)->invalid_point_num;
+        (*root)->tree_deleted = false;
+        (*root)->point_deleted = false;
         (*root)->need_push_down_to_left = true;
         (*root)->need_push_down_to_right = true;
-        // (*root)->invalid_point_num = 0; 
-        return;
+        (*root)->invalid_point_num = 0;
+        return revived_num;
     }
     if (boxpoint.vertex_min[0]-EPSS < (*root)->point.x && boxpoint.vertex_max[0]+EPSS > (*root)->point.x && boxpoint.vertex_min[1]-EPSS < (*root)->point.y && boxpoint.vertex_max[1]+EPSS > (*root)->point.y && boxpoint.vertex_min[2]-EPSS < (*root)->point.z && boxpoint.vertex_max[2]+EPSS > (*root)->point.z){
-        (*root)->point_deleted = (*root)->point_downsample_deleted;
+        if ((*root)->point_deleted && !(*root)->point_downsample_deleted){
+            (*root)->point_deleted = false;
+            revived_num++;
+            if (Revived != nullptr) Revived->push_back((*root)->point);
+        }
     }
-    Operation_Logger_Type add_box_log;
-    struct timespec Timeout;    
-    add_box_log.op = ADD_BOX;
-    add_box_log.boxpoint = boxpoint;
+    if (son_box_intersect(*root, 0, boxpoint)){
+        if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr){
+            revived_num += Add_by_range(&((*root)->left_son_ptr), boxpoint, allow_rebuild, Revived);
+        } else {
+            lock_working_flag();
+            int son_revived_num = Add_by_range(&((*root)->left_son_ptr), boxpoint, false, Revived);
+            // The rebuilt copy no longer holds the revived points, replaying the box on it could not bring them back
+            if (rebuild_flag && son_revived_num > 0) Drop_MultiThread_Rebuild = true;
+            revived_num += son_revived_num;
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+    }
+    if (son_box_intersect(*root, 1, boxpoint)){
+        if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr){
+            revived_num += Add_by_range(&((*root)->right_son_ptr), boxpoint, allow_rebuild, Revived);
+        } else {
+            lock_working_flag();
+            int son_revived_num = Add_by_range(&((*root)->right_son_ptr), boxpoint, false, Revived);
+            if (rebuild_flag && son_revived_num > 0) Drop_MultiThread_Rebuild = true;
+            revived_num += son_revived_num;
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+    }
+    Update(*root);
+    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num) Rebuild_Ptr = nullptr; 
+    bool need_rebuild = allow_rebuild & Criterion_Check((*root));
+    if (need_rebuild) Rebuild(root);
+    return revived_num;
+}
+
+void KD_TREE::Delete_by_region(KD_TREE_NODE ** root, const RegionType & region, bool allow_rebuild){
+    if ((*root) == nullptr || (*root)->tree_deleted) return;
+    // Classified before Make_Writable, so nodes outside the region are not copied away from a snapshot
+    region_relation_set relation = classify_region(region, *root);
+    if (relation == REGION_OUTSIDE) return;
+    Make_Writable(root);
+    Push_Down(*root);
+    if (relation == REGION_INSIDE){
+        (*root)->tree_deleted = true;
+        (*root)->point_deleted = true;
+        (*root)->need_push_down_to_left = true;
+        (*root)->need_push_down_to_right = true;
+        (*root)->invalid_point_num = (*root)->TreeSize;
+        return;
+    }
+    if (point_in_region(region, (*root)->point)) (*root)->point_deleted = true;
+    Operation_Logger_Type delete_region_log;
+    delete_region_log.op = DELETE_REGION;
+    delete_region_log.region = region;
     if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr){
-        Add_by_range(&((*root)->left_son_ptr), boxpoint, allow_rebuild);
+        Delete_by_region(&((*root)->left_son_ptr), region, allow_rebuild);
     } else {
-        pthread_mutex_lock(&working_flag_mutex);
-        Add_by_range(&((*root)->left_son_ptr), boxpoint, false);
+        lock_working_flag();
+        Delete_by_region(&((*root)->left_son_ptr), region, false);
         if (rebuild_flag){
             pthread_mutex_lock(&rebuild_logger_mutex_lock);
-            Rebuild_Logger.push(add_box_log);
-            pthread_mutex_unlock(&rebuild_logger_mutex_lock);                 
-        }        
+            Rebuild_Logger.push(delete_region_log);
+            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+        }
         pthread_mutex_unlock(&working_flag_mutex);
     }
     if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr){
-        Add_by_range(&((*root)->right_son_ptr), boxpoint, allow_rebuild);
+        Delete_by_region(&((*root)->right_son_ptr), region, allow_rebuild);
     } else {
-        pthread_mutex_lock(&working_flag_mutex);
-        Add_by_range(&((*root)->right_son_ptr), boxpoint, false);
+        lock_working_flag();
+        Delete_by_region(&((*root)->right_son_ptr), region, false);
         if (rebuild_flag){
             pthread_mutex_lock(&rebuild_logger_mutex_lock);
-            Rebuild_Logger.push(add_box_log);
-            pthread_mutex_unlock(&rebuild_logger_mutex_lock);                 
+            Rebuild_Logger.push(delete_region_log);
+            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
         }
         pthread_mutex_unlock(&working_flag_mutex);
     }
@@ -744,6 +1894,254 @@ void KD_TREE::Add_by_range(KD_TREE_NODE ** root, BoxPointType boxpoint, bool all
     return;
 }
 
+int KD_TREE::Add_by_region(KD_TREE_NODE ** root, const RegionType & region, bool allow_rebuild, PointVector * Revived){
+    if ((*root) == nullptr || (*root)->invalid_point_num == 0) return 0;
+    region_relation_set relation = classify_region(region, *root);
+    if (relation == REGION_OUTSIDE) return 0;
+    Make_Writable(root);
+    Push_Down(*root);
+    int revived_num = 0;
+    if (relation == REGION_INSIDE && Revived == nullptr && !(*root)->has_downsample_deleted){
+        revived_num = (*root)->invalid_point_num;
+        (*root)->tree_deleted = false;
+        (*root)->point_deleted = false;
+        (*root)->need_push_down_to_left = true;
+        (*root)->need_push_down_to_right = true;
+        (*root)->invalid_point_num = 0;
+        return revived_num;
+    }
+    if ((*root)->point_deleted && !(*root)->point_downsample_deleted && (relation == REGION_INSIDE || point_in_region(region, (*root)->point))){
+        (*root)->point_deleted = false;
+        revived_num++;
+        if (Revived != nullptr) Revived->push_back((*root)->point);
+    }
+    if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr){
+        revived_num += Add_by_region(&((*root)->left_son_ptr), region, allow_rebuild, Revived);
+    } else {
+        lock_working_flag();
+        int son_revived_num = Add_by_region(&((*root)->left_son_ptr), region, false, Revived);
+        if (rebuild_flag && son_revived_num > 0) Drop_MultiThread_Rebuild = true;
+        revived_num += son_revived_num;
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr){
+        revived_num += Add_by_region(&((*root)->right_son_ptr), region, allow_rebuild, Revived);
+    } else {
+        lock_working_flag();
+        int son_revived_num = Add_by_region(&((*root)->right_son_ptr), region, false, Revived);
+        if (rebuild_flag && son_revived_num > 0) Drop_MultiThread_Rebuild = true;
+        revived_num += son_revived_num;
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    Update(*root);
+    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num) Rebuild_Ptr = nullptr; 
+    bool need_rebuild = allow_rebuild & Criterion_Check((*root));
+    if (need_rebuild) Rebuild(root);
+    return revived_num;
+}
+
+region_relation_set KD_TREE::classify_region(const RegionType & region, KD_TREE_NODE * node){
+    float range_min[3] = {node->node_range_x[0], node->node_range_y[0], node->node_range_z[0]};
+    float range_max[3] = {node->node_range_x[1], node->node_range_y[1], node->node_range_z[1]};
+    if (region.shape == REGION_SPHERE){
+        // Nearest and farthest points of the node range from the center
+        float min_dist = 0.0f, max_dist = 0.0f;
+        for (int i = 0; i < 3; i++){
+            float near_dist = max(max(range_min[i] - region.center[i], region.center[i] - range_max[i]), 0.0f);
+            float far_dist = max(region.center[i] - range_min[i], range_max[i] - region.center[i]);
+            min_dist += near_dist * near_dist;
+            max_dist += far_dist * far_dist;
+        }
+        float radius_square = region.radius * region.radius + EPSS;
+        if (min_dist > radius_square) return REGION_OUTSIDE;
+        if (max_dist <= radius_square) return REGION_INSIDE;
+        return REGION_INTERSECT;
+    }
+    bool inside = true;
+    for (int i = 0; i < region.plane_num; i++){
+        // Lowest and highest values of the plane function over the corners of the node range
+        float near_value = 0.0f, far_value = 0.0f;
+        for (int j = 0; j < 3; j++){
+            if (region.planes[i][j] > 0){
+                near_value += region.planes[i][j] * range_min[j];
+                far_value += region.planes[i][j] * range_max[j];
+            } else {
+                near_value += region.planes[i][j] * range_max[j];
+                far_value += region.planes[i][j] * range_min[j];
+            }
+        }
+        if (near_value > region.planes[i][3] + EPSS) return REGION_OUTSIDE;
+        if (far_value > region.planes[i][3] + EPSS) inside = false;
+    }
+    return inside ? REGION_INSIDE : REGION_INTERSECT;
+}
+
+bool KD_TREE::point_in_region(const RegionType & region, PointType point){
+    if (region.shape == REGION_SPHERE){
+        float dx = point.x - region.center[0], dy = point.y - region.center[1], dz = point.z - region.center[2];
+        return dx * dx + dy * dy + dz * dz <= region.radius * region.radius + EPSS;
+    }
+    for (int i = 0; i < region.plane_num; i++){
+        if (region.planes[i][0] * point.x + region.planes[i][1] * point.y + region.planes[i][2] * point.z > region.planes[i][3] + EPSS) return false;
+    }
+    return true;
+}
+
+RegionType Sphere_Region(PointType center, float radius){
+    RegionType region;
+    region.shape = REGION_SPHERE;
+    region.center[0] = center.x;
+    region.center[1] = center.y;
+    region.center[2] = center.z;
+    region.radius = radius;
+    for (int i = 0; i < 3; i++){
+        region.bound.vertex_min[i] = region.center[i] - radius;
+        region.bound.vertex_max[i] = region.center[i] + radius;
+    }
+    return region;
+}
+
+RegionType Oriented_Box_Region(PointType center, const float axes[3][3], const float half_size[3]){
+    RegionType region;
+    float c[3] = {center.x, center.y, center.z};
+    for (int i = 0; i < 3; i++){
+        float offset = axes[i][0] * c[0] + axes[i][1] * c[1] + axes[i][2] * c[2];
+        Add_Region_Plane(region, axes[i][0], axes[i][1], axes[i][2], offset + half_size[i]);
+        Add_Region_Plane(region, -axes[i][0], -axes[i][1], -axes[i][2], -offset + half_size[i]);
+    }
+    for (int j = 0; j < 3; j++){
+        float extent = 0.0f;
+        for (int i = 0; i < 3; i++) extent += fabs(axes[i][j]) * half_size[i];
+        region.bound.vertex_min[j] = c[j] - extent;
+        region.bound.vertex_max[j] = c[j] + extent;
+    }
+    return region;
+}
+
+RegionType Frustum_Region(PointType origin, const float axes[3][3], float horizontal_fov, float vertical_fov, float near_dist, float far_dist){
+    RegionType region;
+    float o[3] = {origin.x, origin.y, origin.z};
+    float tan_h = tan(horizontal_fov / 2), tan_v = tan(vertical_fov / 2);
+    float normal[3];
+    // Near and far planes along the forward axis
+    Add_Region_Plane(region, -axes[0][0], -axes[0][1], -axes[0][2], -(axes[0][0] * o[0] + axes[0][1] * o[1] + axes[0][2] * o[2]) - near_dist);
+    Add_Region_Plane(region, axes[0][0], axes[0][1], axes[0][2], axes[0][0] * o[0] + axes[0][1] * o[1] + axes[0][2] * o[2] + far_dist);
+    // Side planes through the origin: (p - o) . (+-side - tan * forward) <= 0
+    for (int side = 1; side < 3; side++){
+        float tan_half = (side == 1) ? tan_h : tan_v;
+        for (int sign = -1; sign <= 1; sign += 2){
+            for (int j = 0; j < 3; j++) normal[j] = sign * axes[side][j] - tan_half * axes[0][j];
+            Add_Region_Plane(region, normal[0], normal[1], normal[2], normal[0] * o[0] + normal[1] * o[1] + normal[2] * o[2]);
+        }
+    }
+    // Bound of the corners of the near and far rectangles
+    for (int j = 0; j < 3; j++){
+        region.bound.vertex_min[j] = FLT_MAX;
+        region.bound.vertex_max[j] = -FLT_MAX;
+    }
+    for (int k = 0; k < 8; k++){
+        float dist = (k & 1) ? far_dist : near_dist;
+        float side_h = ((k & 2) ? 1 : -1) * dist * tan_h, side_v = ((k & 4) ? 1 : -1) * dist * tan_v;
+        for (int j = 0; j < 3; j++){
+            float corner = o[j] + dist * axes[0][j] + side_h * axes[1][j] + side_v * axes[2][j];
+            region.bound.vertex_min[j] = min(region.bound.vertex_min[j], corner);
+            region.bound.vertex_max[j] = max(region.bound.vertex_max[j], corner);
+        }
+    }
+    return region;
+}
+
+bool Add_Region_Plane(RegionType & region, float normal_x, float normal_y, float normal_z, float offset){
+    if (region.shape != REGION_CONVEX || region.plane_num >= Region_Max_Plane_Num) return false;
+    region.planes[region.plane_num][0] = normal_x;
+    region.planes[region.plane_num][1] = normal_y;
+    region.planes[region.plane_num][2] = normal_z;
+    region.planes[region.plane_num][3] = offset;
+    region.plane_num++;
+    return true;
+}
+
+// Eigenvalues of a symmetric 3x3 matrix in ascending order, in closed form
+static void symmetric_eigenvalues(const double a[6], double eigenvalues[3]){
+    double off = a[1] * a[1] + a[2] * a[2] + a[4] * a[4];
+    if (off <= 0.0){
+        eigenvalues[0] = a[0];
+        eigenvalues[1] = a[3];
+        eigenvalues[2] = a[5];
+        sort(eigenvalues, eigenvalues + 3);
+        return;
+    }
+    double q = (a[0] + a[3] + a[5]) / 3.0;
+    double b0 = a[0] - q, b3 = a[3] - q, b5 = a[5] - q;
+    double p = sqrt((b0 * b0 + b3 * b3 + b5 * b5 + 2.0 * off) / 6.0);
+    // Half the determinant of (A - qI) / p, the cosine of three times the angle of the largest eigenvalue
+    double r = (b0 * (b3 * b5 - a[4] * a[4]) - a[1] * (a[1] * b5 - a[4] * a[2]) + a[2] * (a[1] * a[4] - b3 * a[2])) / (2.0 * p * p * p);
+    r = max(-1.0, min(1.0, r));
+    double phi = acos(r) / 3.0;
+    eigenvalues[2] = q + 2.0 * p * cos(phi);
+    eigenvalues[0] = q + 2.0 * p * cos(phi + 2.0 * M_PI / 3.0);
+    eigenvalues[1] = 3.0 * q - eigenvalues[0] - eigenvalues[2];
+    return;
+}
+
+void Fit_Plane(const PointType_CMP * neighbors, int neighbor_num, PointType query, Plane_Fit_Type & plane){
+    plane = Plane_Fit_Type();
+    plane.point_num = neighbor_num;
+    if (neighbor_num <= 0) return;
+    // Two passes over the neighbors with independent accumulators, so both loops vectorize
+    float sum[3] = {0.0f, 0.0f, 0.0f};
+    for (int i = 0; i < neighbor_num; i++){
+        sum[0] += neighbors[i].point.x;
+        sum[1] += neighbors[i].point.y;
+        sum[2] += neighbors[i].point.z;
+        plane.max_dist = max(plane.max_dist, neighbors[i].dist);
+    }
+    for (int j = 0; j < 3; j++) plane.centroid[j] = sum[j] / neighbor_num;
+    float cov[6] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+    for (int i = 0; i < neighbor_num; i++){
+        float dx = neighbors[i].point.x - plane.centroid[0];
+        float dy = neighbors[i].point.y - plane.centroid[1];
+        float dz = neighbors[i].point.z - plane.centroid[2];
+        cov[0] += dx * dx; cov[1] += dx * dy; cov[2] += dx * dz;
+        cov[3] += dy * dy; cov[4] += dy * dz; cov[5] += dz * dz;
+    }
+    double a[6], eigenvalues[3];
+    for (int j = 0; j < 6; j++){
+        plane.covariance[j] = cov[j] / neighbor_num;
+        a[j] = plane.covariance[j];
+    }
+    symmetric_eigenvalues(a, eigenvalues);
+    for (int j = 0; j < 3; j++) plane.eigenvalues[j] = eigenvalues[j];
+    if (neighbor_num < 3) return;
+    // The normal is orthogonal to the rows of A - eigenvalues[0] I, take the largest cross product of two rows
+    double rows[3][3] = {{a[0] - eigenvalues[0], a[1], a[2]},
+                         {a[1], a[3] - eigenvalues[0], a[4]},
+                         {a[2], a[4], a[5] - eigenvalues[0]}};
+    double best[3] = {0.0, 0.0, 0.0}, best_norm = 0.0;
+    for (int i = 0; i < 3; i++){
+        const double * u = rows[i], * v = rows[(i + 1) % 3];
+        double c[3] = {u[1] * v[2] - u[2] * v[1], u[2] * v[0] - u[0] * v[2], u[0] * v[1] - u[1] * v[0]};
+        double norm = c[0] * c[0] + c[1] * c[1] + c[2] * c[2];
+        if (norm > best_norm){
+            best_norm = norm;
+            memcpy(best, c, sizeof(best));
+        }
+    }
+    // Collinear neighbors leave the two smallest eigenvalues equal and the plane undefined
+    double scale = eigenvalues[2] - eigenvalues[0];
+    if (scale <= 0.0 || best_norm <= 1e-12 * scale * scale * scale * scale) return;
+    best_norm = sqrt(best_norm);
+    for (int j = 0; j < 3; j++) plane.normal[j] = best[j] / best_norm;
+    plane.d = -(plane.normal[0] * plane.centroid[0] + plane.normal[1] * plane.centroid[1] + plane.normal[2] * plane.centroid[2]);
+    plane.residual = plane.normal[0] * query.x + plane.normal[1] * query.y + plane.normal[2] * query.z + plane.d;
+    for (int i = 0; i < neighbor_num; i++){
+        float deviation = plane.normal[0] * neighbors[i].point.x + plane.normal[1] * neighbors[i].point.y + plane.normal[2] * neighbors[i].point.z + plane.d;
+        plane.max_deviation = max(plane.max_deviation, fabsf(deviation));
+    }
+    plane.valid = true;
+    return;
+}
+
 void KD_TREE::Add_by_point(KD_TREE_NODE ** root, PointType point, bool allow_rebuild){     
     if (*root == nullptr){
         *root = new KD_TREE_NODE;
@@ -757,12 +2155,13 @@ void KD_TREE::Add_by_point(KD_TREE_NODE ** root, PointType point, bool allow_reb
     struct timespec Timeout;    
     add_log.op = ADD_POINT;
     add_log.point = point; 
+    Make_Writable(root);
     Push_Down(*root);
     if (((*root)->division_axis == 0 && point.x < (*root)->point.x) || ((*root)->division_axis == 1 && point.y < (*root)->point.y) || ((*root)->division_axis == 2 && point.z < (*root)->point.z)){
         if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr){          
             Add_by_point(&(*root)->left_son_ptr, point, allow_rebuild);
         } else {
-            pthread_mutex_lock(&working_flag_mutex);
+            lock_working_flag();
             Add_by_point(&(*root)->left_son_ptr, point, false);
             if (rebuild_flag){
                 pthread_mutex_lock(&rebuild_logger_mutex_lock);
@@ -775,7 +2174,7 @@ void KD_TREE::Add_by_point(KD_TREE_NODE ** root, PointType point, bool allow_reb
         if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr){         
             Add_by_point(&(*root)->right_son_ptr, point, allow_rebuild);
         } else {
-            pthread_mutex_lock(&working_flag_mutex);
+            lock_working_flag();
             Add_by_point(&(*root)->right_son_ptr, point, false);       
             if (rebuild_flag){
                 pthread_mutex_lock(&rebuild_logger_mutex_lock);
@@ -792,20 +2191,25 @@ void KD_TREE::Add_by_point(KD_TREE_NODE ** root, PointType point, bool allow_reb
     return;
 }
 
-void KD_TREE::Search(KD_TREE_NODE * root, int k_nearest, PointType point, priority_queue<PointType_CMP> &q){
-    if (root == nullptr || root->tree_deleted) return;   
-    int retval; 
-    if (root->need_push_down_to_left || root->need_push_down_to_right) {
-        retval = pthread_mutex_trylock(&(root->push_down_mutex_lock));
-        if (retval == 0){
-            Push_Down(root);
-            pthread_mutex_unlock(&(root->push_down_mutex_lock));
-        } else {
-            pthread_mutex_lock(&(root->push_down_mutex_lock));
-            pthread_mutex_unlock(&(root->push_down_mutex_lock));
-        }
+void KD_TREE::Search(KD_TREE_NODE * root, int k_nearest, PointType point, priority_queue<PointType_CMP> &q, Lazy_Tag_Type tag){
+    if (root == nullptr) return;   
+#if KD_TREE_STATS
+    stats_node_visited++;
+#endif
+    // Pending push-downs are resolved on the fly, so the search never writes to the tree
+    bool point_deleted, tree_deleted;
+    Lazy_Tag_Type left_tag, right_tag;
+    Resolve_Lazy_Tag(root, tag, point_deleted, tree_deleted, left_tag, right_tag);
+    if (tree_deleted) return;
+    // The boxes of both sons are stored in this node, so pruning does not touch the sons
+    float dist_left_node = calc_son_box_dist(root, 0, point);
+    float dist_right_node = calc_son_box_dist(root, 1, point);
+    // Grandsons are not prefetched: their addresses are in the sons, which would have to be loaded first
+    if (search_prefetch){
+        if (q.size() < k_nearest || dist_left_node < q.top().dist) Prefetch_Node(root->left_son_ptr);
+        if (q.size() < k_nearest || dist_right_node < q.top().dist) Prefetch_Node(root->right_son_ptr);
     }
-    if (!root->point_deleted){
+    if (!point_deleted){
         float dist = calc_dist(point, root->point);
         if (q.size() < k_nearest || dist < q.top().dist){
             if (q.size() >= k_nearest) q.pop();
@@ -813,158 +2217,180 @@ void KD_TREE::Search(KD_TREE_NODE * root, int k_nearest, PointType point, priori
             q.push(current_point);            
         }
     }  
-    int cur_search_counter;
-    float dist_left_node = calc_box_dist(root->left_son_ptr, point);
-    float dist_right_node = calc_box_dist(root->right_son_ptr, point);
     if (q.size()< k_nearest || dist_left_node < q.top().dist && dist_right_node < q.top().dist){
         if (dist_left_node <= dist_right_node) {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr){
-                Search(root->left_son_ptr, k_nearest, point,q);                       
-            } else {
-                pthread_mutex_lock(&search_flag_mutex);
-                while (search_mutex_counter == -1)
-                {
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    usleep(1);
-                    pthread_mutex_lock(&search_flag_mutex);
-                }
-                search_mutex_counter += 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-                Search(root->left_son_ptr, k_nearest, point,q);  
-                pthread_mutex_lock(&search_flag_mutex);
-                search_mutex_counter -= 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-            }
-            if (q.size() < k_nearest || dist_right_node < q.top().dist) {
-                if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr){
-                    Search(root->right_son_ptr, k_nearest, point,q);                       
-                } else {
-                    pthread_mutex_lock(&search_flag_mutex);
-                    while (search_mutex_counter == -1)
-                    {
-                        pthread_mutex_unlock(&search_flag_mutex);
-                        usleep(1);
-                        pthread_mutex_lock(&search_flag_mutex);
-                    }
-                    search_mutex_counter += 1;
-                    pthread_mutex_unlock(&search_flag_mutex);                    
-                    Search(root->right_son_ptr, k_nearest, point,q);  
-                    pthread_mutex_lock(&search_flag_mutex);
-                    search_mutex_counter -= 1;
-                    pthread_mutex_unlock(&search_flag_mutex);
-                }                
-            }
+            Search(root->left_son_ptr, k_nearest, point, q, left_tag);
+            if (q.size() < k_nearest || dist_right_node < q.top().dist) Search(root->right_son_ptr, k_nearest, point, q, right_tag);
         } else {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr){
-                Search(root->right_son_ptr, k_nearest, point,q);                       
-            } else {
-                pthread_mutex_lock(&search_flag_mutex);
-                while (search_mutex_counter == -1)
-                {
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    usleep(1);
-                    pthread_mutex_lock(&search_flag_mutex);
-                }
-                search_mutex_counter += 1;
-                pthread_mutex_unlock(&search_flag_mutex);                   
-                Search(root->right_son_ptr, k_nearest, point,q);  
-                pthread_mutex_lock(&search_flag_mutex);
-                search_mutex_counter -= 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-            }
-            if (q.size() < k_nearest || dist_left_node < q.top().dist) {            
-                if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr){
-                    Search(root->left_son_ptr, k_nearest, point,q);                       
-                } else {
-                    pthread_mutex_lock(&search_flag_mutex);
-                    while (search_mutex_counter == -1)
-                    {
-                        pthread_mutex_unlock(&search_flag_mutex);
-                        usleep(1);
-                        pthread_mutex_lock(&search_flag_mutex);
-                    }
-                    search_mutex_counter += 1;
-                    pthread_mutex_unlock(&search_flag_mutex);  
-                    Search(root->left_son_ptr, k_nearest, point,q);  
-                    pthread_mutex_lock(&search_flag_mutex);
-                    search_mutex_counter -= 1;
-                    pthread_mutex_unlock(&search_flag_mutex);
-                }
-            }
+            Search(root->right_son_ptr, k_nearest, point, q, right_tag);
+            if (q.size() < k_nearest || dist_left_node < q.top().dist) Search(root->left_son_ptr, k_nearest, point, q, left_tag);
         }
     } else {
-        if (dist_left_node < q.top().dist) {        
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr){
-                Search(root->left_son_ptr, k_nearest, point,q);                       
-            } else {
-                pthread_mutex_lock(&search_flag_mutex);
-                while (search_mutex_counter == -1)
-                {
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    usleep(1);
-                    pthread_mutex_lock(&search_flag_mutex);
-                }
-                search_mutex_counter += 1;
-                pthread_mutex_unlock(&search_flag_mutex);  
-                Search(root->left_son_ptr, k_nearest, point,q);  
-                pthread_mutex_lock(&search_flag_mutex);
-                search_mutex_counter -= 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-            }
-        }
-        if (dist_right_node < q.top().dist) {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr){
-                Search(root->right_son_ptr, k_nearest, point,q);                       
-            } else {
-                pthread_mutex_lock(&search_flag_mutex);
-                while (search_mutex_counter == -1)
-                {
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    usleep(1);
-                    pthread_mutex_lock(&search_flag_mutex);
-                }
-                search_mutex_counter += 1;
-                pthread_mutex_unlock(&search_flag_mutex);  
-                Search(root->right_son_ptr, k_nearest, point,q);  
-                pthread_mutex_lock(&search_flag_mutex);
-                search_mutex_counter -= 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-            }
-        }
+        if (dist_left_node < q.top().dist) Search(root->left_son_ptr, k_nearest, point, q, left_tag);
+        if (dist_right_node < q.top().dist) Search(root->right_son_ptr, k_nearest, point, q, right_tag);
     }  
     return;
 }
 
-void KD_TREE::Search_by_range(KD_TREE_NODE *root, BoxPointType boxpoint, PointVector & Storage){
+void KD_TREE::Search_by_range(KD_TREE_NODE *root, BoxPointType boxpoint, PointVector & Storage, Lazy_Tag_Type tag){
+    auto visitor = [&Storage](const PointType & point){
+        Storage.push_back(point);
+    };
+    Visit_by_range(root, boxpoint, visitor, tag);
+    return;
+}
+
+template<typename Visitor>
+void KD_TREE::Visit_by_range(KD_TREE_NODE *root, BoxPointType & boxpoint, Visitor & visitor, Lazy_Tag_Type tag){
     if (root == nullptr) return;
-    Push_Down(root);       
+#if KD_TREE_STATS
+    stats_node_visited++;
+#endif
+    bool point_deleted, tree_deleted;
+    Lazy_Tag_Type left_tag, right_tag;
+    Resolve_Lazy_Tag(root, tag, point_deleted, tree_deleted, left_tag, right_tag);
+    if (tree_deleted) return;
     if (boxpoint.vertex_max[0] + EPSS < root->node_range_x[0] || boxpoint.vertex_min[0] - EPSS > root->node_range_x[1]) return;
     if (boxpoint.vertex_max[1] + EPSS < root->node_range_y[0] || boxpoint.vertex_min[1] - EPSS > root->node_range_y[1]) return;
     if (boxpoint.vertex_max[2] + EPSS < root->node_range_z[0] || boxpoint.vertex_min[2] - EPSS > root->node_range_z[1]) return;
     if (boxpoint.vertex_min[0] - EPSS < root->node_range_x[0] && boxpoint.vertex_max[0]+EPSS > root->node_range_x[1] && boxpoint.vertex_min[1]-EPSS < root->node_range_y[0] && boxpoint.vertex_max[1]+EPSS > root->node_range_y[1] && boxpoint.vertex_min[2]-EPSS < root->node_range_z[0] && boxpoint.vertex_max[2]+EPSS > root->node_range_z[1]){
-        flatten(root, Storage);
+        Visit_tree(root, visitor, tag);
         return;
     }
     if (boxpoint.vertex_min[0]-EPSS < root->point.x && boxpoint.vertex_max[0]+EPSS > root->point.x && boxpoint.vertex_min[1]-EPSS < root->point.y && boxpoint.vertex_max[1]+EPSS > root->point.y && boxpoint.vertex_min[2]-EPSS < root->point.z && boxpoint.vertex_max[2]+EPSS > root->point.z){
-        if (!root->point_deleted) Storage.push_back(root->point);
+        if (!point_deleted) visitor(root->point);
     }
-    if ((Rebuild_Ptr == nullptr) || root->left_son_ptr != *Rebuild_Ptr){
-        Search_by_range(root->left_son_ptr, boxpoint, Storage);
-    } else {
-        pthread_mutex_lock(&search_flag_mutex);
-        Search_by_range(root->left_son_ptr, boxpoint, Storage);
-        pthread_mutex_unlock(&search_flag_mutex);
+    if (son_box_intersect(root, 0, boxpoint)){
+        Visit_by_range(root->left_son_ptr, boxpoint, visitor, left_tag);
     }
-    if ((Rebuild_Ptr == nullptr) || root->right_son_ptr != *Rebuild_Ptr){
-        Search_by_range(root->right_son_ptr, boxpoint, Storage);
-    } else {
-        pthread_mutex_lock(&search_flag_mutex);
-        Search_by_range(root->right_son_ptr, boxpoint, Storage);
-        pthread_mutex_unlock(&search_flag_mutex);
+    if (son_box_intersect(root, 1, boxpoint)){
+        Visit_by_range(root->right_son_ptr, boxpoint, visitor, right_tag);
     }
     return;    
 }
 
+template<typename Visitor>
+void KD_TREE::Visit_by_region(KD_TREE_NODE * root, const RegionType & region, Visitor & visitor, Lazy_Tag_Type tag){
+    if (root == nullptr) return;
+#if KD_TREE_STATS
+    stats_node_visited++;
+#endif
+    bool point_deleted, tree_deleted;
+    Lazy_Tag_Type left_tag, right_tag;
+    Resolve_Lazy_Tag(root, tag, point_deleted, tree_deleted, left_tag, right_tag);
+    if (tree_deleted) return;
+    region_relation_set relation = classify_region(region, root);
+    if (relation == REGION_OUTSIDE) return;
+    if (relation == REGION_INSIDE){
+        Visit_tree(root, visitor, tag);
+        return;
+    }
+    if (!point_deleted && point_in_region(region, root->point)) visitor(root->point);
+    Visit_by_region(root->left_son_ptr, region, visitor, left_tag);
+    Visit_by_region(root->right_son_ptr, region, visitor, right_tag);
+    return;
+}
+
+template<typename Visitor>
+void KD_TREE::Visit_tree(KD_TREE_NODE * root, Visitor & visitor, Lazy_Tag_Type tag){
+    if (root == nullptr) return;
+#if KD_TREE_STATS
+    stats_node_visited++;
+#endif
+    bool point_deleted, tree_deleted;
+    Lazy_Tag_Type left_tag, right_tag;
+    Resolve_Lazy_Tag(root, tag, point_deleted, tree_deleted, left_tag, right_tag);
+    if (tree_deleted) return;
+    if (!point_deleted) visitor(root->point);
+    Visit_tree(root->left_son_ptr, visitor, left_tag);
+    Visit_tree(root->right_son_ptr, visitor, right_tag);
+    return;
+}
+
+void KD_TREE::Split_by_range(KD_TREE_NODE * root, BoxPointType & boxpoint, int depth, Range_Search_Context & context, Lazy_Tag_Type tag){
+    if (root == nullptr) return;
+    if (depth == 0){
+        Range_Task_Type task;
+        task.root = root;
+        task.tag = tag;
+        context.tasks.push_back(task);
+        return;
+    }
+    bool point_deleted, tree_deleted;
+    Lazy_Tag_Type left_tag, right_tag;
+    Resolve_Lazy_Tag(root, tag, point_deleted, tree_deleted, left_tag, right_tag);
+    if (tree_deleted) return;
+    if (boxpoint.vertex_max[0] + EPSS < root->node_range_x[0] || boxpoint.vertex_min[0] - EPSS > root->node_range_x[1]) return;
+    if (boxpoint.vertex_max[1] + EPSS < root->node_range_y[0] || boxpoint.vertex_min[1] - EPSS > root->node_range_y[1]) return;
+    if (boxpoint.vertex_max[2] + EPSS < root->node_range_z[0] || boxpoint.vertex_min[2] - EPSS > root->node_range_z[1]) return;
+    if (boxpoint.vertex_min[0]-EPSS < root->point.x && boxpoint.vertex_max[0]+EPSS > root->point.x && boxpoint.vertex_min[1]-EPSS < root->point.y && boxpoint.vertex_max[1]+EPSS > root->point.y && boxpoint.vertex_min[2]-EPSS < root->point.z && boxpoint.vertex_max[2]+EPSS > root->point.z){
+        if (!point_deleted) (*context.visitor)(0, root->point);
+    }
+    if (son_box_intersect(root, 0, boxpoint)){
+        Split_by_range(root->left_son_ptr, boxpoint, depth - 1, context, left_tag);
+    }
+    if (son_box_intersect(root, 1, boxpoint)){
+        Split_by_range(root->right_son_ptr, boxpoint, depth - 1, context, right_tag);
+    }
+    return;
+}
+
+void * KD_TREE::range_thread_ptr(void * arg){
+    Range_Thread_Arg * thread_arg = (Range_Thread_Arg *) arg;
+    thread_arg->context->tree->Range_Task_Loop(*thread_arg->context, thread_arg->thread_index);
+    return nullptr;
+}
+
+void KD_TREE::Range_Task_Loop(Range_Search_Context & context, int thread_index){
+    auto visitor = [&context, thread_index](const PointType & point){
+        (*context.visitor)(thread_index, point);
+    };
+    int task_index;
+    while ((task_index = context.next_task++) < int(context.tasks.size())){
+        Visit_by_range(context.tasks[task_index].root, context.box, visitor, context.tasks[task_index].tag);
+    }
+    return;
+}
+
+void KD_TREE::Add_Batch(KD_TREE_NODE ** root, PointVector & points, int l, int r){
+    if (l > r) return;
+    if (*root == nullptr){
+        BuildTree(root, l, r, points);
+        return;
+    }
+    Make_Writable(root);
+    Push_Down(*root);
+    int axis = (*root)->division_axis;
+    PointType division_point = (*root)->point;
+    // Same side as Add_by_point: points below the division go to the left son
+    int mid = partition(begin(points)+l, begin(points)+r+1, [axis, division_point](const PointType & point){
+        return (axis == 0 && point.x < division_point.x) || (axis == 1 && point.y < division_point.y) || (axis == 2 && point.z < division_point.z);
+    }) - begin(points);
+    // Criterion_Check on the sizes the subtree will have after the batch
+    int tree_size = (*root)->TreeSize + r - l + 1;
+    int left_size = ((*root)->left_son_ptr != nullptr ? (*root)->left_son_ptr->TreeSize : 0) + mid - l;
+    float balance_evaluation = float(left_size) / max(tree_size - 1, 1);
+    float delete_evaluation = float((*root)->invalid_point_num) / tree_size;
+    bool small_tree = tree_size > Minimal_Unbalanced_Tree_Size && tree_size < Multi_Thread_Rebuild_Point_Num;
+    if (small_tree && (delete_evaluation > delete_criterion_param || balance_evaluation > balance_criterion_param || balance_evaluation < 1-balance_criterion_param)){
+        KD_TREE_NODE * father_ptr = (*root)->father_ptr;
+        rebuild_counter += tree_size;
+        PCL_Storage.clear();
+        delete_tree_nodes(root, FLATTEN_REC);
+        Publish_Removed_Points(Points_deleted);
+        PCL_Storage.insert(PCL_Storage.end(), begin(points)+l, begin(points)+r+1);
+        BuildTree(root, 0, PCL_Storage.size()-1, PCL_Storage);
+        if (*root != nullptr) (*root)->father_ptr = father_ptr;
+        return;
+    }
+    Add_Batch(&(*root)->left_son_ptr, points, l, mid-1);
+    Add_Batch(&(*root)->right_son_ptr, points, mid, r);
+    Update(*root);
+    // Larger subtrees are left to the rebuild thread, as with single insertions
+    if (Criterion_Check(*root)) Rebuild(root);
+    return;
+}
+
 bool KD_TREE::Criterion_Check(KD_TREE_NODE * root){
     if (root->TreeSize <= Minimal_Unbalanced_Tree_Size){
         return false;
@@ -986,25 +2412,32 @@ bool KD_TREE::Criterion_Check(KD_TREE_NODE * root){
 
 void KD_TREE::Push_Down(KD_TREE_NODE *root){
     if (root == nullptr) return;
+    // A revived son has no invalid point left: revivals only tag subtrees without downsample deleted points
     Operation_Logger_Type operation;
     operation.op = PUSH_DOWN;
     operation.tree_deleted = root->tree_deleted;
     operation.tree_downsample_deleted = root->tree_downsample_deleted;
     if (root->need_push_down_to_left && root->left_son_ptr != nullptr){
         if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr){
+            Make_Writable(&root->left_son_ptr);
             root->left_son_ptr->tree_downsample_deleted |= root->tree_downsample_deleted;
             root->left_son_ptr->point_downsample_deleted |= root->tree_downsample_deleted;
             root->left_son_ptr->tree_deleted = root->tree_deleted || root->left_son_ptr->tree_downsample_deleted;
             root->left_son_ptr->point_deleted = root->left_son_ptr->tree_deleted || root->left_son_ptr->point_downsample_deleted;
+            root->left_son_ptr->has_downsample_deleted |= root->tree_downsample_deleted;
+            root->left_son_ptr->invalid_point_num = root->left_son_ptr->tree_deleted ? root->left_son_ptr->TreeSize : 0;
             root->left_son_ptr->need_push_down_to_left = true;
             root->left_son_ptr->need_push_down_to_right = true;
             root->need_push_down_to_left = false;                
         } else {
-            pthread_mutex_lock(&working_flag_mutex);
+            lock_working_flag();
+            Make_Writable(&root->left_son_ptr);
             root->left_son_ptr->tree_downsample_deleted |= root->tree_downsample_deleted;
             root->left_son_ptr->point_downsample_deleted |= root->tree_downsample_deleted;
             root->left_son_ptr->tree_deleted = root->tree_deleted || root->left_son_ptr->tree_downsample_deleted;
             root->left_son_ptr->point_deleted = root->left_son_ptr->tree_deleted || root->left_son_ptr->point_downsample_deleted;
+            root->left_son_ptr->has_downsample_deleted |= root->tree_downsample_deleted;
+            root->left_son_ptr->invalid_point_num = root->left_son_ptr->tree_deleted ? root->left_son_ptr->TreeSize : 0;
             root->left_son_ptr->need_push_down_to_left = true;
             root->left_son_ptr->need_push_down_to_right = true;
             if (rebuild_flag){
@@ -1018,19 +2451,25 @@ void KD_TREE::Push_Down(KD_TREE_NODE *root){
     }
     if (root->need_push_down_to_right && root->right_son_ptr != nullptr){
         if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr){
+            Make_Writable(&root->right_son_ptr);
             root->right_son_ptr->tree_downsample_deleted |= root->tree_downsample_deleted;
             root->right_son_ptr->point_downsample_deleted |= root->tree_downsample_deleted;
             root->right_son_ptr->tree_deleted = root->tree_deleted || root->right_son_ptr->tree_downsample_deleted;
             root->right_son_ptr->point_deleted = root->right_son_ptr->tree_deleted || root->right_son_ptr->point_downsample_deleted;
+            root->right_son_ptr->has_downsample_deleted |= root->tree_downsample_deleted;
+            root->right_son_ptr->invalid_point_num = root->right_son_ptr->tree_deleted ? root->right_son_ptr->TreeSize : 0;
             root->right_son_ptr->need_push_down_to_left = true;
             root->right_son_ptr->need_push_down_to_right = true;
             root->need_push_down_to_right = false;
         } else {
-            pthread_mutex_lock(&working_flag_mutex);
+            lock_working_flag();
+            Make_Writable(&root->right_son_ptr);
             root->right_son_ptr->tree_downsample_deleted |= root->tree_downsample_deleted;
             root->right_son_ptr->point_downsample_deleted |= root->tree_downsample_deleted;
             root->right_son_ptr->tree_deleted = root->tree_deleted || root->right_son_ptr->tree_downsample_deleted;
             root->right_son_ptr->point_deleted = root->right_son_ptr->tree_deleted || root->right_son_ptr->point_downsample_deleted;
+            root->right_son_ptr->has_downsample_deleted |= root->tree_downsample_deleted;
+            root->right_son_ptr->invalid_point_num = root->right_son_ptr->tree_deleted ? root->right_son_ptr->TreeSize : 0;
             root->right_son_ptr->need_push_down_to_left = true;
             root->right_son_ptr->need_push_down_to_right = true;
             if (rebuild_flag){
@@ -1045,6 +2484,27 @@ void KD_TREE::Push_Down(KD_TREE_NODE *root){
     return;
 }
 
+void KD_TREE::Resolve_Lazy_Tag(KD_TREE_NODE * root, Lazy_Tag_Type tag, bool & point_deleted, bool & tree_deleted, Lazy_Tag_Type & left_tag, Lazy_Tag_Type & right_tag){
+    // Same rules as Push_Down, applied to local copies of the flags
+    bool tree_downsample_deleted = root->tree_downsample_deleted;
+    bool point_downsample_deleted = root->point_downsample_deleted;
+    point_deleted = root->point_deleted;
+    tree_deleted = root->tree_deleted;
+    left_tag.push_down = root->need_push_down_to_left;
+    right_tag.push_down = root->need_push_down_to_right;
+    if (tag.push_down){
+        tree_downsample_deleted |= tag.tree_downsample_deleted;
+        point_downsample_deleted |= tag.tree_downsample_deleted;
+        tree_deleted = tag.tree_deleted || tree_downsample_deleted;
+        point_deleted = tree_deleted || point_downsample_deleted;
+        left_tag.push_down = true;
+        right_tag.push_down = true;
+    }
+    left_tag.tree_deleted = right_tag.tree_deleted = tree_deleted;
+    left_tag.tree_downsample_deleted = right_tag.tree_downsample_deleted = tree_downsample_deleted;
+    return;
+}
+
 void KD_TREE::Update(KD_TREE_NODE * root){
     KD_TREE_NODE * left_son_ptr = root->left_son_ptr;
     KD_TREE_NODE * right_son_ptr = root->right_son_ptr;
@@ -1054,6 +2514,7 @@ void KD_TREE::Update(KD_TREE_NODE * root){
         root->invalid_point_num = left_son_ptr->invalid_point_num + right_son_ptr->invalid_point_num + (root->point_deleted? 1:0);
         root->tree_downsample_deleted = left_son_ptr->tree_downsample_deleted & right_son_ptr->tree_downsample_deleted & root->point_downsample_deleted;
         root->tree_deleted = left_son_ptr->tree_deleted && right_son_ptr->tree_deleted && root->point_deleted;
+        root->has_downsample_deleted = left_son_ptr->has_downsample_deleted || right_son_ptr->has_downsample_deleted || root->point_downsample_deleted;
         root->node_range_x[0] = min(min(left_son_ptr->node_range_x[0],right_son_ptr->node_range_x[0]),root->point.x);
         root->node_range_x[1] = max(max(left_son_ptr->node_range_x[1],right_son_ptr->node_range_x[1]),root->point.x);
         root->node_range_y[0] = min(min(left_son_ptr->node_range_y[0],right_son_ptr->node_range_y[0]),root->point.y);
@@ -1065,6 +2526,7 @@ void KD_TREE::Update(KD_TREE_NODE * root){
         root->invalid_point_num = left_son_ptr->invalid_point_num + (root->point_deleted?1:0);
         root->tree_downsample_deleted = left_son_ptr->tree_downsample_deleted & root->point_downsample_deleted;
         root->tree_deleted = left_son_ptr->tree_deleted && root->point_deleted;
+        root->has_downsample_deleted = left_son_ptr->has_downsample_deleted || root->point_downsample_deleted;
         root->node_range_x[0] = min(left_son_ptr->node_range_x[0],root->point.x);
         root->node_range_x[1] = max(left_son_ptr->node_range_x[1],root->point.x);
         root->node_range_y[0] = min(left_son_ptr->node_range_y[0],root->point.y);
@@ -1075,7 +2537,8 @@ void KD_TREE::Update(KD_TREE_NODE * root){
         root->TreeSize = right_son_ptr->TreeSize + 1;
         root->invalid_point_num = right_son_ptr->invalid_point_num + (root->point_deleted? 1:0);
         root->tree_downsample_deleted = right_son_ptr->tree_downsample_deleted & root->point_downsample_deleted;
-        root->tree_deleted = right_son_ptr->tree_deleted && root->point_deleted;        
+        root->tree_deleted = right_son_ptr->tree_deleted && root->point_deleted;
+        root->has_downsample_deleted = right_son_ptr->has_downsample_deleted || root->point_downsample_deleted;
         root->node_range_x[0] = min(right_son_ptr->node_range_x[0],root->point.x);
         root->node_range_x[1] = max(right_son_ptr->node_range_x[1],root->point.x);
         root->node_range_y[0] = min(right_son_ptr->node_range_y[0],root->point.y);
@@ -1087,6 +2550,7 @@ void KD_TREE::Update(KD_TREE_NODE * root){
         root->invalid_point_num = (root->point_deleted? 1:0);
         root->tree_downsample_deleted = root->point_downsample_deleted;
         root->tree_deleted = root->point_deleted;
+        root->has_downsample_deleted = root->point_downsample_deleted;
         root->node_range_x[0] = root->point.x;
         root->node_range_x[1] = root->point.x;        
         root->node_range_y[0] = root->point.y;
@@ -1094,59 +2558,93 @@ void KD_TREE::Update(KD_TREE_NODE * root){
         root->node_range_z[0] = root->point.z;
         root->node_range_z[1] = root->point.z;                 
     }
+    Update_Son_Range(root);
     if (left_son_ptr != nullptr) left_son_ptr -> father_ptr = root;
     if (right_son_ptr != nullptr) right_son_ptr -> father_ptr = root;
     if (root == Root_Node && root->TreeSize > 3){
         KD_TREE_NODE * son_ptr = root->left_son_ptr;
         if (son_ptr == nullptr) son_ptr = root->right_son_ptr;
         float tmp_bal = float(son_ptr->TreeSize) / (root->TreeSize-1);
-        root->alpha_del = float(root->invalid_point_num)/ root->TreeSize;
-        root->alpha_bal = (tmp_bal>=0.5-EPSS)?tmp_bal:1-tmp_bal;
+        root_alpha_del = float(root->invalid_point_num)/ root->TreeSize;
+        root_alpha_bal = (tmp_bal>=0.5-EPSS)?tmp_bal:1-tmp_bal;
     }
     return;
 }
 
-void KD_TREE::flatten(KD_TREE_NODE * root, PointVector &Storage){
-    if (root == nullptr || root->tree_deleted) return;
-    Push_Down(root);
-    if (!root->point_deleted) {
+void KD_TREE::flatten(KD_TREE_NODE * root, PointVector &Storage, Lazy_Tag_Type tag){
+    if (root == nullptr) return;
+    bool point_deleted, tree_deleted;
+    Lazy_Tag_Type left_tag, right_tag;
+    Resolve_Lazy_Tag(root, tag, point_deleted, tree_deleted, left_tag, right_tag);
+    if (tree_deleted) return;
+    if (!point_deleted) {
         Storage.push_back(root->point);
     }
-    flatten(root->left_son_ptr, Storage);
-    flatten(root->right_son_ptr, Storage);
+    flatten(root->left_son_ptr, Storage, left_tag);
+    flatten(root->right_son_ptr, Storage, right_tag);
     return;
 }
 
-void KD_TREE::delete_tree_nodes(KD_TREE_NODE ** root, delete_point_storage_set storage_type){ 
+void KD_TREE::delete_tree_nodes(KD_TREE_NODE ** root, delete_point_storage_set storage_type, Lazy_Tag_Type tag){ 
     if (*root == nullptr) return;
-    Push_Down(*root);    
-    delete_tree_nodes(&(*root)->left_son_ptr, storage_type);
-    delete_tree_nodes(&(*root)->right_son_ptr, storage_type);  
+    KD_TREE_NODE * node = *root;
+    *root = nullptr;
+    // Subtrees shared with a snapshot are kept alive by it, their points still leave this tree
+    if (node->ref_num > 1){
+        record_tree_points(node, storage_type, tag);
+        Release_Node(node);
+        return;
+    }
+    bool point_deleted, tree_deleted;
+    Lazy_Tag_Type left_tag, right_tag;
+    Resolve_Lazy_Tag(node, tag, point_deleted, tree_deleted, left_tag, right_tag);
+    delete_tree_nodes(&node->left_son_ptr, storage_type, left_tag);
+    delete_tree_nodes(&node->right_son_ptr, storage_type, right_tag);  
+    record_point(node, storage_type, tag, point_deleted);
+    Free_Tree_Node(node);
+    return;
+}
+
+void KD_TREE::record_tree_points(KD_TREE_NODE * root, delete_point_storage_set storage_type, Lazy_Tag_Type tag){
+    if (root == nullptr || storage_type == NOT_RECORD) return;
+    bool point_deleted, tree_deleted;
+    Lazy_Tag_Type left_tag, right_tag;
+    Resolve_Lazy_Tag(root, tag, point_deleted, tree_deleted, left_tag, right_tag);
+    record_tree_points(root->left_son_ptr, storage_type, left_tag);
+    record_tree_points(root->right_son_ptr, storage_type, right_tag);
+    record_point(root, storage_type, tag, point_deleted);
+    return;
+}
+
+void KD_TREE::record_point(KD_TREE_NODE * root, delete_point_storage_set storage_type, Lazy_Tag_Type tag, bool point_deleted){
+    bool point_downsample_deleted = root->point_downsample_deleted || (tag.push_down && tag.tree_downsample_deleted);
     switch (storage_type)
     {
     case NOT_RECORD:
         break;
     case DELETE_POINTS_REC:
-        if ((*root)->point_deleted && !(*root)->point_downsample_deleted) {
-            Points_deleted.push_back((*root)->point);
+        if (point_deleted && !point_downsample_deleted) {
+            Points_deleted.push_back(root->point);
         }       
         break;
     case MULTI_THREAD_REC:
-        pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);    
-        if ((*root)->point_deleted  && !(*root)->point_downsample_deleted) {
-            Multithread_Points_deleted.push_back((*root)->point);
+        if (point_deleted && !point_downsample_deleted) {
+            Multithread_Points_deleted.push_back(root->point);
         }
-        pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);     
         break;
     case DOWNSAMPLE_REC:
-        if (!(*root)->point_deleted) Downsample_Storage.push_back((*root)->point);
+        if (!point_deleted) Downsample_Storage.push_back(root->point);
+        break;
+    case FLATTEN_REC:
+        if (!point_deleted) {
+            PCL_Storage.push_back(root->point);
+        } else if (!point_downsample_deleted) {
+            Points_deleted.push_back(root->point);
+        }
         break;
     default:
         break;
     }               
-    delete *root;
-    *root = nullptr;                    
-
     return;
 }
 
@@ -1160,31 +2658,138 @@ float KD_TREE::calc_dist(PointType a, PointType b){
     return dist;
 }
 
-float KD_TREE::calc_box_dist(KD_TREE_NODE * node, PointType point){
-    if (node == nullptr) return INFINITY;
+uint16_t KD_TREE::quantize_range_min(float value, float range_min, float range_max){
+    if (!(range_max > range_min)) return 0;
+    float code = floor((value - range_min) / (range_max - range_min) * 65535.0f);
+    int result = int(max(0.0f, min(code, 65535.0f)));
+    // Round down until the decoded bound is not above the real one
+    while (result > 0 && dequantize_range(result, range_min, range_max) > value) result--;
+    return result;
+}
+
+uint16_t KD_TREE::quantize_range_max(float value, float range_min, float range_max){
+    if (!(range_max > range_min)) return 65535;
+    float code = ceil((value - range_min) / (range_max - range_min) * 65535.0f);
+    int result = int(max(0.0f, min(code, 65535.0f)));
+    // Round up until the decoded bound is not below the real one
+    while (result < 65535 && dequantize_range(result, range_min, range_max) < value) result++;
+    return result;
+}
+
+float KD_TREE::dequantize_range(uint16_t code, float range_min, float range_max){
+    if (code == 65535) return range_max;
+    return range_min + (range_max - range_min) * (1.0f / 65535.0f) * float(code);
+}
+
+void KD_TREE::Update_Son_Range(KD_TREE_NODE * root){
+    KD_TREE_NODE * son_ptr[2] = {root->left_son_ptr, root->right_son_ptr};
+    for (int i = 0; i < 2; i++){
+        if (son_ptr[i] == nullptr) continue;
+        root->son_range[i][0] = quantize_range_min(son_ptr[i]->node_range_x[0], root->node_range_x[0], root->node_range_x[1]);
+        root->son_range[i][1] = quantize_range_max(son_ptr[i]->node_range_x[1], root->node_range_x[0], root->node_range_x[1]);
+        root->son_range[i][2] = quantize_range_min(son_ptr[i]->node_range_y[0], root->node_range_y[0], root->node_range_y[1]);
+        root->son_range[i][3] = quantize_range_max(son_ptr[i]->node_range_y[1], root->node_range_y[0], root->node_range_y[1]);
+        root->son_range[i][4] = quantize_range_min(son_ptr[i]->node_range_z[0], root->node_range_z[0], root->node_range_z[1]);
+        root->son_range[i][5] = quantize_range_max(son_ptr[i]->node_range_z[1], root->node_range_z[0], root->node_range_z[1]);
+    }
+    return;
+}
+
+void KD_TREE::son_box_range(KD_TREE_NODE * node, int son, float range[6]){
+    range[0] = dequantize_range(node->son_range[son][0], node->node_range_x[0], node->node_range_x[1]);
+    range[1] = dequantize_range(node->son_range[son][1], node->node_range_x[0], node->node_range_x[1]);
+    range[2] = dequantize_range(node->son_range[son][2], node->node_range_y[0], node->node_range_y[1]);
+    range[3] = dequantize_range(node->son_range[son][3], node->node_range_y[0], node->node_range_y[1]);
+    range[4] = dequantize_range(node->son_range[son][4], node->node_range_z[0], node->node_range_z[1]);
+    range[5] = dequantize_range(node->son_range[son][5], node->node_range_z[0], node->node_range_z[1]);
+    return;
+}
+
+bool KD_TREE::son_box_intersect(KD_TREE_NODE * node, int son, BoxPointType & boxpoint){
+    if ((son == 0 ? node->left_son_ptr : node->right_son_ptr) == nullptr) return false;
+    float range[6];
+    son_box_range(node, son, range);
+    if (boxpoint.vertex_max[0] + EPSS < range[0] || boxpoint.vertex_min[0] - EPSS > range[1]) return false;
+    if (boxpoint.vertex_max[1] + EPSS < range[2] || boxpoint.vertex_min[1] - EPSS > range[3]) return false;
+    if (boxpoint.vertex_max[2] + EPSS < range[4] || boxpoint.vertex_min[2] - EPSS > range[5]) return false;
+    return true;
+}
+
+float KD_TREE::calc_son_box_dist(KD_TREE_NODE * node, int son, PointType point){
+    if ((son == 0 ? node->left_son_ptr : node->right_son_ptr) == nullptr) return INFINITY;
+    float range[6];
+    son_box_range(node, son, range);
     float min_dist = 0.0;
-    if (point.x < node->node_range_x[0]) min_dist += (point.x - node->node_range_x[0])*(point.x - node->node_range_x[0]);
-    if (point.x > node->node_range_x[1]) min_dist += (point.x - node->node_range_x[1])*(point.x - node->node_range_x[1]);
-    if (point.y < node->node_range_y[0]) min_dist += (point.y - node->node_range_y[0])*(point.y - node->node_range_y[0]);
-    if (point.y > node->node_range_y[1]) min_dist += (point.y - node->node_range_y[1])*(point.y - node->node_range_y[1]);
-    if (point.z < node->node_range_z[0]) min_dist += (point.z - node->node_range_z[0])*(point.z - node->node_range_z[0]);
-    if (point.z > node->node_range_z[1]) min_dist += (point.z - node->node_range_z[1])*(point.z - node->node_range_z[1]);
+    if (point.x < range[0]) min_dist += (point.x - range[0])*(point.x - range[0]);
+    if (point.x > range[1]) min_dist += (point.x - range[1])*(point.x - range[1]);
+    if (point.y < range[2]) min_dist += (point.y - range[2])*(point.y - range[2]);
+    if (point.y > range[3]) min_dist += (point.y - range[3])*(point.y - range[3]);
+    if (point.z < range[4]) min_dist += (point.z - range[4])*(point.z - range[4]);
+    if (point.z > range[5]) min_dist += (point.z - range[5])*(point.z - range[5]);
     return min_dist;
 }
 
+void KD_TREE::Prefetch_Node(KD_TREE_NODE * node){
+    if (node == nullptr) return;
+    const char * address = (const char *) node;
+    for (int offset = 0; offset < int(sizeof(KD_TREE_NODE)); offset += 64) __builtin_prefetch(address + offset);
+    __builtin_prefetch(address + sizeof(KD_TREE_NODE) - 1);
+    return;
+}
+
+uint32_t KD_TREE::expand_morton_bits(uint32_t v){
+    // Spread the lower 10 bits so that two zero bits separate each of them
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+void KD_TREE::Morton_Order(const PointVector & points, vector<int> & order, vector<pair<uint32_t, int>> & codes){
+    int n = points.size();
+    order.resize(n);
+    if (n == 0) return;
+    float min_xyz[3] = {points[0].x, points[0].y, points[0].z};
+    float max_xyz[3] = {points[0].x, points[0].y, points[0].z};
+    for (int i = 1; i < n; i++){
+        min_xyz[0] = min(min_xyz[0], points[i].x); max_xyz[0] = max(max_xyz[0], points[i].x);
+        min_xyz[1] = min(min_xyz[1], points[i].y); max_xyz[1] = max(max_xyz[1], points[i].y);
+        min_xyz[2] = min(min_xyz[2], points[i].z); max_xyz[2] = max(max_xyz[2], points[i].z);
+    }
+    float scale[3];
+    for (int j = 0; j < 3; j++){
+        scale[j] = (max_xyz[j] - min_xyz[j] > EPSS) ? 1023.0f / (max_xyz[j] - min_xyz[j]) : 0.0f;
+    }
+    // Quantize every query to 10 bits per axis inside the batch bounding box
+    codes.resize(n);
+    uint32_t cell[3];
+    for (int i = 0; i < n; i++){
+        cell[0] = min(uint32_t((points[i].x - min_xyz[0]) * scale[0]), 1023u);
+        cell[1] = min(uint32_t((points[i].y - min_xyz[1]) * scale[1]), 1023u);
+        cell[2] = min(uint32_t((points[i].z - min_xyz[2]) * scale[2]), 1023u);
+        codes[i].first = expand_morton_bits(cell[0]) | (expand_morton_bits(cell[1]) << 1) | (expand_morton_bits(cell[2]) << 2);
+        codes[i].second = i;
+    }
+    sort(codes.begin(), codes.end());
+    for (int i = 0; i < n; i++) order[i] = codes[i].second;
+    return;
+}
+
 bool KD_TREE::point_cmp_x(PointType a, PointType b) { return a.x < b.x;}
 bool KD_TREE::point_cmp_y(PointType a, PointType b) { return a.y < b.y;}
 bool KD_TREE::point_cmp_z(PointType a, PointType b) { return a.z < b.z;}
 
 void KD_TREE::print_tree(int index, FILE *fp, float x_min, float x_max, float y_min, float y_max, float z_min, float z_max){
-    pthread_mutex_lock(&working_flag_mutex);
+    lock_search_read();
+    lock_working_flag();
     print_treenode(Root_Node, index, fp, x_min,x_max,y_min,y_max,z_min,z_max);
     pthread_mutex_unlock(&working_flag_mutex);       
+    pthread_rwlock_unlock(&search_rwlock);
 }
 
 void KD_TREE::print_treenode(KD_TREE_NODE * root, int index, FILE *fp, float x_min, float x_max, float y_min, float y_max, float z_min, float z_max){
     if (root == nullptr) return;
-    Push_Down(root);
     fprintf(fp,"%d,%0.3f,%0.3f,%0.3f",index,root->point.x,root->point.y,root->point.z);
     fprintf(fp,",%0.3f,%0.3f,%0.3f,%0.3f,%0.3f,%0.3f\n",x_min,x_max,y_min,y_max,z_min,z_max);
     switch (root->division_axis)
@@ -1205,4 +2810,56 @@ void KD_TREE::print_treenode(KD_TREE_NODE * root, int index, FILE *fp, float x_m
         break;
     }
     return;    
-}
\ No newline at end of file
+}
+KD_TREE_SNAPSHOT::~KD_TREE_SNAPSHOT(){
+    KD_TREE::Release_Node(root);
+}
+
+int KD_TREE_SNAPSHOT::size(){
+    if (root == nullptr) return 0;
+    return root->TreeSize;
+}
+
+int KD_TREE_SNAPSHOT::validnum(){
+    if (root == nullptr) return 0;
+    return root->TreeSize - root->invalid_point_num;
+}
+
+void KD_TREE_SNAPSHOT::Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> & Point_Distance){
+    Nearest_Search(default_search_context, point, k_nearest, Nearest_Points, Point_Distance);
+    return;
+}
+
+void KD_TREE_SNAPSHOT::Nearest_Search(Nearest_Search_Context & context, PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> & Point_Distance){
+    // Nodes reachable from a snapshot are never written, so no lock is taken
+    context.heap.clear();
+    tree->Search(root, k_nearest, point, context.heap);
+    tree->Collect_Nearest(context.heap, k_nearest, Nearest_Points, Point_Distance);
+    return;
+}
+
+void KD_TREE_SNAPSHOT::Box_Search(BoxPointType box, PointVector & Storage){
+    Storage.clear();
+    tree->Search_by_range(root, box, Storage);
+    return;
+}
+
+void KD_TREE_SNAPSHOT::Region_Search(const RegionType & region, PointVector & Storage){
+    Storage.clear();
+    auto visitor = [&Storage](const PointType & point){
+        Storage.push_back(point);
+    };
+    tree->Visit_by_region(root, region, visitor);
+    return;
+}
+
+void KD_TREE_SNAPSHOT::Box_Search(BoxPointType box, const Point_Visitor & visitor){
+    tree->Visit_by_range(root, box, visitor);
+    return;
+}
+
+void KD_TREE_SNAPSHOT::flatten(PointVector & Storage){
+    Storage.clear();
+    tree->flatten(root, Storage);
+    return;
+}
@@ -1,3 +1,4 @@
+#pragma once
 #include <pthread.h>
 #include <stdio.h>
 #include <queue>
@@ -7,43 +8,103 @@
 #include <math.h>
 #include <algorithm>
 #include <memory.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <float.h>
+#include <unordered_map>
 
 #define EPSS 1e-6
 #define Minimal_Unbalanced_Tree_Size 5
 #define Multi_Thread_Rebuild_Point_Num 1500
 #define DOWNSAMPLE_SWITCH false
 #define ForceRebuildPercentage 0.2
+#define Node_Block_Size 1024
+#define Rebuild_Wait_Time 10
+#define Range_Search_Task_Num 4
+#define Invalid_Point_ID 0xFFFFFFFFu
+#define Region_Max_Plane_Num 8
+#define Voxel_Cache_Ring_Num 2
+// Build with -DKD_TREE_STATS=1 to collect the statistics returned by Get_Stats, otherwise they cost nothing
+#ifndef KD_TREE_STATS
+#define KD_TREE_STATS 0
+#endif
+#define Stats_Bucket_Num 32
+#define Trace_Version 1
 
 using namespace std;
 
 struct PointType
 {
     float x,y,z;
+    // Stable id, assigned by the tree on insertion when the point has none
+    uint32_t id = Invalid_Point_ID;
 };
 
 typedef vector<PointType> PointVector;
 
+struct KD_TREE_NODE;
 
+// Rebuilt subtrees up to Node_Block_Size nodes are laid out contiguously in DFS order
+struct KD_TREE_NODE_BLOCK
+{
+    KD_TREE_NODE * nodes;
+    int node_num;
+    int used_num;
+    atomic<int> alive_num;
+};
+
+// Fields are ordered to avoid padding; push-down locks and balance records live in KD_TREE
 struct KD_TREE_NODE
 {
     PointType point;
-    int division_axis;  
     int TreeSize = 1;
     int invalid_point_num = 0;
-    bool point_deleted = false;
-    bool tree_deleted = false; 
-    bool point_downsample_deleted = false;
-    bool tree_downsample_deleted = false;
-    bool need_push_down_to_left = false;
-    bool need_push_down_to_right = false;
-    pthread_mutex_t push_down_mutex_lock;
+    // Packed into two bytes, set by InitTreeNode
+    uint8_t division_axis : 2;
+    bool point_deleted : 1;
+    bool tree_deleted : 1;
+    bool point_downsample_deleted : 1;
+    bool tree_downsample_deleted : 1;
+    bool need_push_down_to_left : 1;
+    bool need_push_down_to_right : 1;
+    // Some point of the subtree is downsample deleted, such a subtree is revived node by node
+    bool has_downsample_deleted : 1;
     float node_range_x[2], node_range_y[2], node_range_z[2];   
+    // Ranges of both sons (x min/max, y min/max, z min/max), quantized to 16 bits inside this node's range
+    uint16_t son_range[2][6];
+    // Number of fathers and snapshots referring to the node, shared nodes are copied before a write
+    atomic<int> ref_num{1};
     KD_TREE_NODE *left_son_ptr = nullptr;
     KD_TREE_NODE *right_son_ptr = nullptr;
     KD_TREE_NODE *father_ptr = nullptr;
-    // For paper data record
-    float alpha_del;
-    float alpha_bal;
+    KD_TREE_NODE_BLOCK *block_ptr = nullptr;
+};
+
+// Columnar per-point attribute indexed by point id, e.g. Point_Payload<float> intensity
+template<typename T>
+class Point_Payload
+{
+private:
+    vector<T> values;
+public:
+    void set(uint32_t id, const T & value){
+        if (id >= values.size()) values.resize(id + 1);
+        values[id] = value;
+    }
+    T & operator[](uint32_t id){
+        return values[id];
+    }
+    const T & operator[](uint32_t id) const{
+        return values[id];
+    }
+    bool contains(uint32_t id) const{
+        return id < values.size();
+    }
+    void reserve(uint32_t id_num){
+        values.reserve(id_num);
+    }
 };
 
 struct PointType_CMP{
@@ -58,24 +119,219 @@ struct PointType_CMP{
     }    
 };
 
+// Max-heap of search candidates that keeps its storage when cleared
+class PointType_Heap : public priority_queue<PointType_CMP>{
+public:
+    void clear(){
+        c.clear();
+    }
+    void reserve(int n){
+        c.reserve(n);
+    }
+    // The candidates in heap order, not sorted by distance
+    const PointType_CMP * data() const{
+        return c.data();
+    }
+};
+
+// Scratch buffers of the nearest searches, keep one per thread so repeated searches do not allocate
+struct Nearest_Search_Context{
+    PointType_Heap heap;
+    vector<int> query_order;
+    vector<pair<uint32_t, int>> morton_codes;
+};
+
+// Plane normal . p + d = 0 fitted to the neighbors of a query, the normal is the axis of least variance
+struct Plane_Fit_Type{
+    int point_num = 0;
+    float max_dist = 0.0f;              // squared distance of the farthest neighbor
+    float centroid[3] = {0.0f, 0.0f, 0.0f};
+    float covariance[6] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};   // xx, xy, xz, yy, yz, zz
+    float eigenvalues[3] = {0.0f, 0.0f, 0.0f};                    // ascending
+    float normal[3] = {0.0f, 0.0f, 0.0f};
+    float d = 0.0f;
+    float residual = 0.0f;              // signed distance of the query to the plane
+    float max_deviation = 0.0f;         // largest distance of a neighbor to the plane
+    bool valid = false;                 // at least 3 neighbors, not all on a line
+};
+
+void Fit_Plane(const PointType_CMP * neighbors, int neighbor_num, PointType query, Plane_Fit_Type & plane);
+
+// Rigid transform p' = rotation * p + translation, rotation stored by rows
+struct Rigid_Transform_Type{
+    float rotation[3][3] = {{1.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f}, {0.0f, 0.0f, 1.0f}};
+    float translation[3] = {0.0f, 0.0f, 0.0f};
+};
+
 struct BoxPointType{
     float vertex_min[3];
     float vertex_max[3];
 };
 
+enum region_shape_set {REGION_SPHERE, REGION_CONVEX};
+
+enum region_relation_set {REGION_OUTSIDE, REGION_INTERSECT, REGION_INSIDE};
+
+// Sphere, or convex polyhedron made of the half-spaces normal . p <= offset, stored as {normal, offset}.
+// bound encloses the region; the builders below set it, Add_Region_Plane leaves it unbounded.
+struct RegionType{
+    region_shape_set shape = REGION_CONVEX;
+    float center[3] = {0.0f, 0.0f, 0.0f};
+    float radius = 0.0f;
+    int plane_num = 0;
+    float planes[Region_Max_Plane_Num][4];
+    BoxPointType bound = {{-FLT_MAX, -FLT_MAX, -FLT_MAX}, {FLT_MAX, FLT_MAX, FLT_MAX}};
+};
+
+RegionType Sphere_Region(PointType center, float radius);
+// axes holds the three unit axes of the box as rows, half_size its half extent along each
+RegionType Oriented_Box_Region(PointType center, const float axes[3][3], const float half_size[3]);
+// axes holds the forward, left and up unit vectors of the sensor as rows; fields of view are full angles in radians
+RegionType Frustum_Region(PointType origin, const float axes[3][3], float horizontal_fov, float vertical_fov, float near_dist, float far_dist);
+bool Add_Region_Plane(RegionType & region, float normal_x, float normal_y, float normal_z, float offset);
 
-enum operation_set {ADD_POINT, DELETE_POINT, DELETE_BOX, ADD_BOX, DOWNSAMPLE_DELETE, PUSH_DOWN};
+enum operation_set {ADD_POINT, DELETE_POINT, DELETE_BOX, ADD_BOX, DOWNSAMPLE_DELETE, PUSH_DOWN, DELETE_REGION, ADD_REGION};
+
+enum delete_point_storage_set {NOT_RECORD, DELETE_POINTS_REC, MULTI_THREAD_REC, DOWNSAMPLE_REC, FLATTEN_REC};
+
+enum async_operation_set {ASYNC_ADD_POINTS, ASYNC_DELETE_POINTS, ASYNC_ADD_BOXES, ASYNC_DELETE_BOXES, ASYNC_ADD_REGIONS, ASYNC_DELETE_REGIONS};
+
+// Push-down pending from the father, resolved by read-only traversals instead of being written to the sons
+struct Lazy_Tag_Type{
+    bool push_down = false;
+    bool tree_deleted = false;
+    bool tree_downsample_deleted = false;
+};
+
+typedef function<void(const PointType &)> Point_Visitor;
+// Called with the index of the thread that found the point, from 0 to thread_num-1
+typedef function<void(int, const PointType &)> Parallel_Point_Visitor;
+
+struct Range_Task_Type{
+    KD_TREE_NODE * root;
+    Lazy_Tag_Type tag;
+};
 
-enum delete_point_storage_set {NOT_RECORD, DELETE_POINTS_REC, MULTI_THREAD_REC, DOWNSAMPLE_REC};
+class KD_TREE;
+
+struct Range_Search_Context{
+    KD_TREE * tree;
+    BoxPointType box;
+    const Parallel_Point_Visitor * visitor;
+    vector<Range_Task_Type> tasks;
+    atomic<int> next_task{0};
+};
+
+enum stats_operation_set {STATS_BUILD, STATS_ADD_POINTS, STATS_DELETE_POINTS, STATS_ADD_BOXES, STATS_DELETE_BOXES, STATS_ADD_REGIONS, STATS_DELETE_REGIONS, STATS_NEAREST_SEARCH, STATS_BOX_SEARCH, STATS_REGION_SEARCH, STATS_OPERATION_NUM};
+
+enum stats_lock_set {STATS_SEARCH_READ_LOCK, STATS_SEARCH_WRITE_LOCK, STATS_WORKING_FLAG_LOCK, STATS_LOCK_NUM};
+
+// Durations in nanoseconds; bucket[0] counts those under 1 us, bucket[i] those in [2^(i-1), 2^i) us, the last bucket the rest
+struct Stats_Histogram_Type{
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+    uint64_t bucket[Stats_Bucket_Num] = {};
+};
+
+struct Tree_Stats_Type{
+    Stats_Histogram_Type operation[STATS_OPERATION_NUM];
+    // Nodes visited by the searches of each operation
+    uint64_t node_visited[STATS_OPERATION_NUM] = {};
+    // Only acquisitions that had to wait are timed, lock_acquired counts all of them
+    Stats_Histogram_Type lock_wait[STATS_LOCK_NUM];
+    uint64_t lock_acquired[STATS_LOCK_NUM] = {};
+    // Background rebuilds, from flattening to the swap of the new subtree
+    Stats_Histogram_Type rebuild;
+    uint64_t rebuild_point_num = 0, rebuild_max_point_num = 0;
+    // Subtrees smaller than Multi_Thread_Rebuild_Point_Num, rebuilt by the writer
+    uint64_t writer_rebuild_num = 0, writer_rebuild_point_num = 0;
+    int logger_depth = 0, logger_max_depth = 0;
+    // Nearest searches answered by the voxel cache, and those that fell back to the tree
+    uint64_t voxel_cache_hit_num = 0, voxel_cache_miss_num = 0;
+    int tree_size = 0, valid_num = 0;
+    float tombstone_ratio = 0.0f;
+};
+
+#if KD_TREE_STATS
+// Updated by concurrent searches, so every field is atomic
+struct Stats_Counter_Type{
+    atomic<uint64_t> count{0}, total_ns{0}, max_ns{0};
+    atomic<uint64_t> bucket[Stats_Bucket_Num];
+    Stats_Counter_Type(){
+        for (int i = 0; i < Stats_Bucket_Num; i++) bucket[i].store(0);
+    }
+    void Record(uint64_t duration_ns);
+    void Copy(Stats_Histogram_Type & histogram);
+    void Reset();
+};
+#endif
+
+enum trace_operation_set {TRACE_BUILD, TRACE_ADD_POINTS, TRACE_DELETE_POINTS, TRACE_ADD_BOXES, TRACE_DELETE_BOXES, TRACE_ADD_REGIONS, TRACE_DELETE_REGIONS,
+        TRACE_NEAREST_SEARCH, TRACE_BOX_SEARCH, TRACE_BOX_SEARCH_PARALLEL, TRACE_REGION_SEARCH, TRACE_OPERATION_NUM};
+
+// A trace file is a Trace_Header_Type followed by records, each followed by count raw PointType, BoxPointType or RegionType
+struct Trace_Header_Type{
+    char magic[4];
+    uint32_t version;
+    uint32_t point_size;
+    float delete_param, balance_param, box_length;
+};
+
+// param is k for nearest search, downsample_on for insertion and the thread number for parallel box search
+struct Trace_Record_Type{
+    uint32_t op;
+    int32_t param;
+    uint32_t count;
+    uint32_t thread;
+    uint64_t time_ns;
+};
+
+struct Range_Thread_Arg{
+    Range_Search_Context * context;
+    int thread_index;
+};
 
 struct Operation_Logger_Type{
     PointType point;
     BoxPointType boxpoint;
+    RegionType region;
     bool tree_deleted, tree_downsample_deleted;
     operation_set op;
 };
 
+// Update queued for the async writer thread, only the batch matching op is used
+struct Async_Operation_Type{
+    async_operation_set op;
+    uint64_t sequence = 0;
+    bool downsample_on = false;
+    PointVector points;
+    vector<BoxPointType> boxes;
+    vector<RegionType> regions;
+};
+
+
+class KD_TREE_SNAPSHOT;
 
+/*
+    Concurrency: any number of threads may call Nearest_Search and Nearest_Search_Batch while a
+    single thread calls Build, Add_Points, Add_Point_Boxes, Delete_Points, Delete_Point_Boxes and
+    their region counterparts.
+    Searches never write to the tree and hold search_rwlock for reading; the writer takes it for
+    writing per inserted or deleted point and per box, so searches interleave with a large update.
+    Box_Search and its variants are searches too; their visitors run under the read lock and must
+    not update the tree. flatten and Root_Node take no lock and belong to the writer thread; Export_Points
+    is the locked counterpart of flatten.
+
+    The Async variants of the updates queue their batch for a writer thread owned by the tree and return
+    its sequence number at once; that thread then is the single writer. Searches see the updates applied
+    so far, Wait_For_Sequence(N) first makes them see every update up to N. Synchronous updates, Snapshot
+    and Start_Trace first wait until every queued update is applied.
+
+    Snapshot, called from the writer thread, returns a read-only view of the current tree that
+    shares all nodes with it. The writer copies a shared node before modifying it, so each update
+    after a snapshot duplicates only the path it touches.
+*/
 class KD_TREE
 {
 private:
@@ -86,13 +342,14 @@ private:
     bool rebuild_flag = false;
     bool copy_flag = false;
     pthread_t rebuild_thread;
-    pthread_mutex_t termination_flag_mutex_lock, rebuild_ptr_mutex_lock, working_flag_mutex, search_flag_mutex;
+    pthread_mutex_t termination_flag_mutex_lock, rebuild_ptr_mutex_lock, working_flag_mutex;
+    pthread_rwlock_t search_rwlock;
+    pthread_cond_t rebuild_signal;
     pthread_mutex_t rebuild_logger_mutex_lock, points_deleted_rebuild_mutex_lock;
     // vector<Operation_Logger_Type> Rebuild_Logger;
     queue<Operation_Logger_Type> Rebuild_Logger;
     PointVector Rebuild_PCL_Storage;
-    KD_TREE_NODE ** Rebuild_Ptr;
-    int search_mutex_counter = 0;
+    KD_TREE_NODE ** Rebuild_Ptr = nullptr;
     static void * multi_thread_ptr(void *arg);
     void multi_thread_rebuild();
     void start_thread();
@@ -100,38 +357,122 @@ private:
     void run_operation(KD_TREE_NODE ** root, Operation_Logger_Type operation);
     // KD Tree Functions and augmented variables
     int Treesize_tmp = 0, Validnum_tmp = 0;
-    float alpha_bal_tmp = 0.5, alpha_del_tmp = 0.0;
+    // For paper data record
+    float root_alpha_bal = 0.5, root_alpha_del = 0.0;
     float delete_criterion_param = 0.5f;
     float balance_criterion_param = 0.7f;
     float downsample_size = 0.2f;
     bool Drop_MultiThread_Rebuild = false;
     bool Delete_Storage_Disabled = false;
+    bool search_prefetch = true;
+    uint32_t point_id_num = 0;
+#if KD_TREE_STATS
+    Stats_Counter_Type operation_stats[STATS_OPERATION_NUM], lock_stats[STATS_LOCK_NUM], rebuild_stats;
+    atomic<uint64_t> node_visited_stats[STATS_OPERATION_NUM], lock_acquired_stats[STATS_LOCK_NUM];
+    atomic<uint64_t> rebuild_point_stats{0}, rebuild_max_point_stats{0}, writer_rebuild_stats{0}, writer_rebuild_point_stats{0};
+    atomic<uint64_t> voxel_cache_hit_stats{0}, voxel_cache_miss_stats{0};
+    int logger_max_depth = 0;
+#endif
+    // Copy of the valid points hashed by voxel, updated by the writer under the write lock
+    float voxel_cache_size = 0.0f;
+    int voxel_cache_ring = Voxel_Cache_Ring_Num;
+    unordered_map<uint64_t, PointVector> voxel_cache;
+    pthread_mutex_t trace_mutex;
+    FILE * trace_fp = nullptr;
+    atomic<bool> trace_on{false};
+    uint64_t trace_start_ns = 0;
     KD_TREE_NODE * STATIC_ROOT_NODE = nullptr;
+    // Async updates, applied in sequence order by async_thread
+    pthread_t async_thread;
+    bool async_started = false, async_termination = false;
+    pthread_mutex_t async_mutex;
+    pthread_cond_t async_signal, async_applied_signal;
+    queue<Async_Operation_Type> async_queue;
+    uint64_t async_sequence = 0, async_applied_sequence = 0;
+    static void * async_thread_ptr(void * arg);
+    void Async_Loop();
+    void Wait_For_Async();
+    uint64_t Enqueue_Async(Async_Operation_Type & operation);
+    void stop_async_thread();
+    // Points removed by rebuilds of the writer and of the rebuild thread, each collected without lock and
+    // handed over to Removed_Points, which is guarded by points_deleted_rebuild_mutex_lock
     PointVector Points_deleted;
     PointVector Downsample_Storage;
     PointVector Multithread_Points_deleted;
+    PointVector Removed_Points;
     void InitTreeNode(KD_TREE_NODE * root);
+    void Publish_Removed_Points(PointVector & points);
     void Test_Lock_States(KD_TREE_NODE *root);
-    void BuildTree(KD_TREE_NODE ** root, int l, int r, PointVector & Storage);
+    KD_TREE_NODE * New_Tree_Node(KD_TREE_NODE_BLOCK * block);
+    static void Free_Tree_Node(KD_TREE_NODE * node);
+    static void Release_Node(KD_TREE_NODE * node);
+    void Make_Writable(KD_TREE_NODE ** root);
+    uint64_t Stats_Begin();
+    void Stats_End(stats_operation_set op, uint64_t start_ns);
+    void lock_search_read();
+    void lock_search_write();
+    void lock_working_flag();
+    void Trace_Record(trace_operation_set op, int param, const void * data, uint32_t count, size_t item_size);
+    void Cancel_Rebuild();
+    int voxel_coord(float value);
+    static uint64_t voxel_key(int ix, int iy, int iz);
+    void Cache_Add_Point(const PointType & point);
+    void Cache_Delete_Point(const PointType & point);
+    void Cache_Delete_Box(const BoxPointType & box);
+    void Cache_Refresh_Voxel(int ix, int iy, int iz);
+    void Cache_Refresh_Box(const BoxPointType & box);
+    void Cache_Rebuild();
+    bool Cache_Search(PointType point, int k_nearest, PointType_Heap & q);
+    void Search_Nearest(PointType point, int k_nearest, PointType_Heap & q);
+    void BuildTree(KD_TREE_NODE ** root, int l, int r, PointVector & Storage, KD_TREE_NODE_BLOCK * block = nullptr);
     void Rebuild(KD_TREE_NODE ** root);
+    void Build_Locked(PointVector & point_cloud);
     void Delete_by_range(KD_TREE_NODE ** root, BoxPointType boxpoint, bool allow_rebuild, bool is_downsample);
-    void Delete_by_point(KD_TREE_NODE ** root, PointType point, bool allow_rebuild);
+    bool Delete_by_point(KD_TREE_NODE ** root, PointType point, bool allow_rebuild);
     void Add_by_point(KD_TREE_NODE ** root, PointType point, bool allow_rebuild);
-    void Add_by_range(KD_TREE_NODE ** root, BoxPointType boxpoint, bool allow_rebuild);
-    void Search(KD_TREE_NODE * root, int k_nearest, PointType point, priority_queue<PointType_CMP> &q);
-    void Search_by_range(KD_TREE_NODE *root, BoxPointType boxpoint, PointVector &Storage);
+    void Add_Batch(KD_TREE_NODE ** root, PointVector & points, int l, int r);
+    int Add_by_range(KD_TREE_NODE ** root, BoxPointType boxpoint, bool allow_rebuild, PointVector * Revived = nullptr);
+    void Delete_by_region(KD_TREE_NODE ** root, const RegionType & region, bool allow_rebuild);
+    int Add_by_region(KD_TREE_NODE ** root, const RegionType & region, bool allow_rebuild, PointVector * Revived = nullptr);
+    static region_relation_set classify_region(const RegionType & region, KD_TREE_NODE * node);
+    static bool point_in_region(const RegionType & region, PointType point);
+    void Search(KD_TREE_NODE * root, int k_nearest, PointType point, priority_queue<PointType_CMP> &q, Lazy_Tag_Type tag = Lazy_Tag_Type());
+    void Search_by_range(KD_TREE_NODE *root, BoxPointType boxpoint, PointVector &Storage, Lazy_Tag_Type tag = Lazy_Tag_Type());
+    template<typename Visitor> void Visit_by_range(KD_TREE_NODE * root, BoxPointType & boxpoint, Visitor & visitor, Lazy_Tag_Type tag = Lazy_Tag_Type());
+    template<typename Visitor> void Visit_by_region(KD_TREE_NODE * root, const RegionType & region, Visitor & visitor, Lazy_Tag_Type tag = Lazy_Tag_Type());
+    template<typename Visitor> void Visit_tree(KD_TREE_NODE * root, Visitor & visitor, Lazy_Tag_Type tag = Lazy_Tag_Type());
+    void Split_by_range(KD_TREE_NODE * root, BoxPointType & boxpoint, int depth, Range_Search_Context & context, Lazy_Tag_Type tag = Lazy_Tag_Type());
+    static void * range_thread_ptr(void * arg);
+    void Range_Task_Loop(Range_Search_Context & context, int thread_index);
     bool Criterion_Check(KD_TREE_NODE * root);
     void Push_Down(KD_TREE_NODE * root);
+    void Resolve_Lazy_Tag(KD_TREE_NODE * root, Lazy_Tag_Type tag, bool & point_deleted, bool & tree_deleted, Lazy_Tag_Type & left_tag, Lazy_Tag_Type & right_tag);
     void Update(KD_TREE_NODE * root); 
-    void delete_tree_nodes(KD_TREE_NODE ** root, delete_point_storage_set storage_type);
+    void delete_tree_nodes(KD_TREE_NODE ** root, delete_point_storage_set storage_type, Lazy_Tag_Type tag = Lazy_Tag_Type());
+    void record_tree_points(KD_TREE_NODE * root, delete_point_storage_set storage_type, Lazy_Tag_Type tag);
+    void record_point(KD_TREE_NODE * root, delete_point_storage_set storage_type, Lazy_Tag_Type tag, bool point_deleted);
     void downsample(KD_TREE_NODE ** root);
     bool same_point(PointType a, PointType b);
     float calc_dist(PointType a, PointType b);
-    float calc_box_dist(KD_TREE_NODE * node, PointType point);    
+    void Update_Son_Range(KD_TREE_NODE * root);
+    static uint16_t quantize_range_min(float value, float range_min, float range_max);
+    static uint16_t quantize_range_max(float value, float range_min, float range_max);
+    static float dequantize_range(uint16_t code, float range_min, float range_max);
+    void son_box_range(KD_TREE_NODE * node, int son, float range[6]);
+    bool son_box_intersect(KD_TREE_NODE * node, int son, BoxPointType & boxpoint);
+    float calc_son_box_dist(KD_TREE_NODE * node, int son, PointType point);    
+    void Prefetch_Node(KD_TREE_NODE * node);
     static bool point_cmp_x(PointType a, PointType b); 
     static bool point_cmp_y(PointType a, PointType b); 
     static bool point_cmp_z(PointType a, PointType b); 
+    static uint32_t expand_morton_bits(uint32_t v);
+    void Assign_Point_IDs(PointVector & points);
+    void Morton_Order(const PointVector & points, vector<int> & order, vector<pair<uint32_t, int>> & codes);
+    void Batch_Order(Nearest_Search_Context & context, const PointVector & Query_Points, bool sort_queries);
     void print_treenode(KD_TREE_NODE * root, int index, FILE *fp, float x_min, float x_max, float y_min, float y_max, float z_min, float z_max);
+    int Collect_Nearest(PointType_Heap & q, int k_nearest, PointType * Nearest_Points, float * Point_Distance);
+    void Collect_Nearest(PointType_Heap & q, int k_nearest, PointVector &Nearest_Points, vector<float> & Point_Distance);
+    friend class KD_TREE_SNAPSHOT;
 
 public:
     KD_TREE(float delete_param = 0.5, float balance_param = 0.6 , float box_length = 0.2);
@@ -139,20 +480,87 @@ public:
     void Set_delete_criterion_param(float delete_param);
     void Set_balance_criterion_param(float balance_param);
     void set_downsample_param(float box_length);
+    void Set_search_prefetch(bool prefetch_on);
+    // Keeps a copy of the valid points hashed by voxel; nearest searches first probe up to max_ring rings of voxels
+    // around the query and descend the tree only when those voxels do not prove the k-th distance. 0 disables it.
+    void Set_voxel_cache(float voxel_size, int max_ring = Voxel_Cache_Ring_Num);
     void InitializeKDTree(float delete_param = 0.5, float balance_param = 0.7, float box_length = 0.2); 
     int size();
     int validnum();
     void root_alpha(float &alpha_bal, float &alpha_del);
+    // The tree is built in place in point_cloud, pass it with std::move to avoid copying it.
+    // Points without id are numbered in input order from the value of next_point_id() before the call.
     void Build(PointVector point_cloud);
+    template<typename Iterator> void Build(Iterator first, Iterator last){
+        Build(PointVector(first, last));
+    }
+    // The outputs are resized rather than freed, so passing the same vectors again reuses their capacity
     void Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> & Point_Distance);
+    void Nearest_Search(Nearest_Search_Context & context, PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> & Point_Distance);
+    // Writes the results into arrays of at least k_nearest entries and returns how many were found
+    int Nearest_Search(Nearest_Search_Context & context, PointType point, int k_nearest, PointType * Nearest_Points, float * Point_Distance);
+    // Results are stored at the index of each query; sort_queries dispatches them along a Morton curve for cache reuse
+    void Nearest_Search_Batch(PointVector & Query_Points, int k_nearest, vector<PointVector> & Nearest_Points, vector<vector<float>> & Point_Distance, bool sort_queries = true);
+    void Nearest_Search_Batch(Nearest_Search_Context & context, PointVector & Query_Points, int k_nearest, vector<PointVector> & Nearest_Points, vector<vector<float>> & Point_Distance, bool sort_queries = true);
+    // Fits a plane to the k nearest neighbors while they are still in the search heap, without copying them out
+    void Nearest_Plane_Search(PointType point, int k_nearest, Plane_Fit_Type & Plane);
+    void Nearest_Plane_Search(Nearest_Search_Context & context, PointType point, int k_nearest, Plane_Fit_Type & Plane);
+    void Nearest_Plane_Search_Batch(PointVector & Query_Points, int k_nearest, vector<Plane_Fit_Type> & Planes, bool sort_queries = true);
+    void Nearest_Plane_Search_Batch(Nearest_Search_Context & context, PointVector & Query_Points, int k_nearest, vector<Plane_Fit_Type> & Planes, bool sort_queries = true);
+    // Search for the body frame points moved by transform, each point is transformed inside the query loop instead of
+    // into a new cloud; the order is computed in the body frame, which a rigid transform does not change
+    void Nearest_Search_Batch(const PointVector & Body_Points, const Rigid_Transform_Type & transform, int k_nearest, vector<PointVector> & Nearest_Points, vector<vector<float>> & Point_Distance, bool sort_queries = true);
+    void Nearest_Search_Batch(Nearest_Search_Context & context, const PointVector & Body_Points, const Rigid_Transform_Type & transform, int k_nearest, vector<PointVector> & Nearest_Points, vector<vector<float>> & Point_Distance, bool sort_queries = true);
+    void Nearest_Plane_Search_Batch(const PointVector & Body_Points, const Rigid_Transform_Type & transform, int k_nearest, vector<Plane_Fit_Type> & Planes, bool sort_queries = true);
+    void Nearest_Plane_Search_Batch(Nearest_Search_Context & context, const PointVector & Body_Points, const Rigid_Transform_Type & transform, int k_nearest, vector<Plane_Fit_Type> & Planes, bool sort_queries = true);
+    // Stores the id assigned to each point into PointToAdd; a batch large enough to be inserted in one pass is
+    // also reordered
     void Add_Points(PointVector & PointToAdd, bool downsample_on);
-    void Add_Point_Boxes(vector<BoxPointType> & BoxPoints);
+    // Returns the number of points revived; with Revived_Points they are also appended there, which visits
+    // every revived point instead of tagging whole subtrees
+    int Add_Point_Boxes(vector<BoxPointType> & BoxPoints, PointVector * Revived_Points = nullptr);
+    // A point that carries an id deletes only the point with that id, otherwise any point at its position
     void Delete_Points(PointVector & PointToDel);
     void Delete_Point_Boxes(vector<BoxPointType> & BoxPoints);
-    void flatten(KD_TREE_NODE * root, PointVector &Storage);
+    void Box_Search(BoxPointType box, PointVector & Storage);
+    void Box_Search(BoxPointType box, const Point_Visitor & visitor);
+    // Fills at most capacity points; returns the number of points in the box, which may exceed capacity
+    int Box_Search(BoxPointType box, PointType * output, int capacity);
+    // Subtrees below the top levels are shared between thread_num threads, the calling thread included
+    void Box_Search_Parallel(BoxPointType box, int thread_num, const Parallel_Point_Visitor & visitor);
+    // Region counterparts of the box operations, one traversal per region
+    int Add_Point_Regions(vector<RegionType> & Regions, PointVector * Revived_Points = nullptr);
+    void Delete_Point_Regions(vector<RegionType> & Regions);
+    void Region_Search(const RegionType & region, PointVector & Storage);
+    void Region_Search(const RegionType & region, const Point_Visitor & visitor);
+    void flatten(KD_TREE_NODE * root, PointVector &Storage, Lazy_Tag_Type tag = Lazy_Tag_Type());
+    // The valid points, read under the search lock so a background rebuild cannot free nodes under it
+    void Export_Points(PointVector & Storage);
+    // Appends the points removed since the last call to removed_points, in O(1) when it is empty; may be
+    // called from any thread
     void acquire_removed_points(PointVector & removed_points);
+    shared_ptr<KD_TREE_SNAPSHOT> Snapshot();
+    // Queue the update for the async writer thread and return its sequence number, starting at 1. Point ids
+    // are assigned when the update is applied, and revived points are not reported
+    uint64_t Add_Points_Async(PointVector PointToAdd, bool downsample_on);
+    uint64_t Delete_Points_Async(PointVector PointToDel);
+    uint64_t Add_Point_Boxes_Async(vector<BoxPointType> BoxPoints);
+    uint64_t Delete_Point_Boxes_Async(vector<BoxPointType> BoxPoints);
+    uint64_t Add_Point_Regions_Async(vector<RegionType> Regions);
+    uint64_t Delete_Point_Regions_Async(vector<RegionType> Regions);
+    // Highest sequence whose update, and every one before it, is visible to searches
+    uint64_t Applied_Sequence();
+    void Wait_For_Sequence(uint64_t sequence);
+    uint32_t next_point_id();
     void print_tree(int index, FILE *fp, float x_min, float x_max, float y_min, float y_max, float z_min, float z_max);
     BoxPointType tree_range();
+    // Records every later public call into file_name, starting with a Build of the current points; called by the writer thread.
+    // ikd_Tree_benchmark replay re-executes the trace.
+    bool Start_Trace(const char * file_name);
+    void Stop_Trace();
+    // All zero unless built with KD_TREE_STATS
+    Tree_Stats_Type Get_Stats();
+    void Reset_Stats();
     PointVector PCL_Storage;     
     KD_TREE_NODE * Root_Node = nullptr;  
     vector<float> add_rec,delete_rec;
@@ -160,3 +568,22 @@ public:
     int rebuild_counter = 0;
     // void Compatibility_Check();
 };
+
+// Read-only view of a KD_TREE, safe to search from any thread; it must not be searched after its tree is destroyed
+class KD_TREE_SNAPSHOT
+{
+private:
+    KD_TREE * tree = nullptr;
+    KD_TREE_NODE * root = nullptr;
+    friend class KD_TREE;
+public:
+    ~KD_TREE_SNAPSHOT();
+    int size();
+    int validnum();
+    void Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> & Point_Distance);
+    void Nearest_Search(Nearest_Search_Context & context, PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> & Point_Distance);
+    void Box_Search(BoxPointType box, PointVector & Storage);
+    void Box_Search(BoxPointType box, const Point_Visitor & visitor);
+    void Region_Search(const RegionType & region, PointVector & Storage);
+    void flatten(PointVector & Storage);
+};
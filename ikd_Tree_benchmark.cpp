@@ -0,0 +1,1325 @@
+#include "ikd_Tree.h"
+#include "ikd_Forest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <random>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <thread>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define X_MAX 50.0
+#define X_MIN -50.0
+#define Y_MAX 50.0
+#define Y_MIN -50.0
+#define Z_MAX 5.0
+#define Z_MIN -5.0
+
+#define Map_Point_Num 500000
+#define Large_Map_Point_Num 4000000
+#define Query_Num 100000
+#define Nearest_Num 5
+#define Repeat_Time 5
+#define Random_Seed 20210221
+#define Forest_Map_Range 500.0
+#define Forest_Scan_Num 20
+#define Forest_Scan_Point_Num 20000
+#define Forest_Resident_Point_Num 200000
+#define Suite_Small_Map_Num 100000
+#define Suite_Large_Map_Num 500000
+#define Suite_Quick_Map_Num 20000
+#define Suite_Query_Num 20000
+#define Suite_Quick_Query_Num 2000
+#define Suite_Batch_Repeat 10
+#define Suite_Box_Num 500
+#define Suite_Box_Length 2.0
+#define Lidar_Ring_Num 32
+#define Lidar_Ring_Point_Num 1024
+#define Lidar_Max_Range 60.0
+#define Lidar_Step_Length 1.0
+#define Street_Half_Width 12.0
+#define Cluster_Num 64
+#define Cluster_Sigma 0.5
+#define Stress_Iteration_Num 2000
+#define Stress_Map_Point_Num 20000
+#define Stress_Query_Num 20
+#define Stress_Max_Nearest_Num 10
+#define Stress_Box_Length 6.0
+#define Stress_Snapshot_Interval 10
+#define Voxel_Update_Point_Num 10000
+#define Async_Update_Point_Num 50000
+
+PointVector map_cloud;
+PointVector query_cloud;
+
+mt19937 rng(Random_Seed);
+
+float rand_float(float x_min, float x_max){
+    uniform_real_distribution<float> distribution(x_min, x_max);
+    return distribution(rng);
+}
+
+/*
+    Linux hardware counter, reads as -1 when perf events are not accessible
+*/
+
+struct Perf_Counter{
+    int fd = -1;
+    Perf_Counter(uint32_t type, uint64_t config){
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    ~Perf_Counter(){
+        if (fd >= 0) close(fd);
+    }
+    void start(){
+        if (fd < 0) return;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    long long stop(){
+        long long count = -1;
+        if (fd < 0) return count;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) count = -1;
+        return count;
+    }
+};
+
+/*
+    Generate the map points used to build the incremental k-d tree
+*/
+
+void generate_map_cloud(int num){
+    PointVector ().swap(map_cloud);
+    PointType new_point;
+    for (int i = 0; i < num; i++){
+        new_point.x = rand_float(X_MIN, X_MAX);
+        new_point.y = rand_float(Y_MIN, Y_MAX);
+        new_point.z = rand_float(Z_MIN, Z_MAX);
+        map_cloud.push_back(new_point);
+    }
+    return;
+}
+
+/*
+    Generate unordered query points, as in a scan whose points arrive in random order
+*/
+
+void generate_query_cloud(int num){
+    PointVector ().swap(query_cloud);
+    PointType new_point;
+    for (int i = 0; i < num; i++){
+        new_point.x = rand_float(X_MIN, X_MAX);
+        new_point.y = rand_float(Y_MIN, Y_MAX);
+        new_point.z = rand_float(Z_MIN, Z_MAX);
+        query_cloud.push_back(new_point);
+    }
+    return;
+}
+
+/*
+    Compare batched nearest search with and without Morton ordering of the queries
+*/
+
+void benchmark_query_order(KD_TREE & tree){
+    vector<PointVector> search_result;
+    vector<vector<float>> search_dist;
+    double sorted_time = 0.0, unsorted_time = 0.0;
+    for (int round = 0; round < Repeat_Time; round++){
+        auto t1 = chrono::high_resolution_clock::now();
+        tree.Nearest_Search_Batch(query_cloud, Nearest_Num, search_result, search_dist, false);
+        auto t2 = chrono::high_resolution_clock::now();
+        tree.Nearest_Search_Batch(query_cloud, Nearest_Num, search_result, search_dist, true);
+        auto t3 = chrono::high_resolution_clock::now();
+        unsorted_time += chrono::duration_cast<chrono::microseconds>(t2-t1).count();
+        sorted_time += chrono::duration_cast<chrono::microseconds>(t3-t2).count();
+    }
+    unsorted_time /= Repeat_Time;
+    sorted_time /= Repeat_Time;
+    printf("Query order (%d queries, k = %d):\n", int(query_cloud.size()), Nearest_Num);
+    printf("    Unsorted: %0.3f ms, %0.0f queries/s\n", unsorted_time/1e3, query_cloud.size()/unsorted_time*1e6);
+    printf("    Morton:   %0.3f ms, %0.0f queries/s\n", sorted_time/1e3, query_cloud.size()/sorted_time*1e6);
+    printf("    Speedup:  %0.2fx\n", unsorted_time/sorted_time);
+    return;
+}
+
+/*
+    Measure child prefetching in nearest search on a map larger than the last level cache
+*/
+
+void benchmark_prefetch(KD_TREE & tree){
+    vector<PointVector> search_result;
+    vector<vector<float>> search_dist;
+    Perf_Counter cache_misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    Perf_Counter llc_load_misses(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    printf("Search prefetch (%d queries, k = %d):\n", int(query_cloud.size()), Nearest_Num);
+    for (int prefetch_on = 0; prefetch_on < 2; prefetch_on++){
+        double search_time = 0.0;
+        long long miss_num = 0, llc_miss_num = 0;
+        tree.Set_search_prefetch(prefetch_on);
+        for (int round = 0; round < Repeat_Time; round++){
+            cache_misses.start();
+            llc_load_misses.start();
+            auto t1 = chrono::high_resolution_clock::now();
+            tree.Nearest_Search_Batch(query_cloud, Nearest_Num, search_result, search_dist, false);
+            auto t2 = chrono::high_resolution_clock::now();
+            llc_miss_num += llc_load_misses.stop();
+            miss_num += cache_misses.stop();
+            search_time += chrono::duration_cast<chrono::microseconds>(t2-t1).count();
+        }
+        search_time /= Repeat_Time;
+        printf("    Prefetch %s: %0.3f ms, %0.0f queries/s", prefetch_on ? "on " : "off", search_time/1e3, query_cloud.size()/search_time*1e6);
+        if (cache_misses.fd >= 0) printf(", %0.1f cache misses/query", double(miss_num)/Repeat_Time/query_cloud.size());
+        if (llc_load_misses.fd >= 0) printf(", %0.1f LLC load misses/query", double(llc_miss_num)/Repeat_Time/query_cloud.size());
+        if (cache_misses.fd < 0 && llc_load_misses.fd < 0) printf(", perf counters unavailable");
+        printf("\n");
+    }
+    tree.Set_search_prefetch(true);
+    return;
+}
+
+/*
+    Compare plane fitting on the copied search results with the fused plane search, as in point-to-plane matching
+*/
+
+void benchmark_plane_fit(KD_TREE & tree){
+    vector<PointVector> search_result;
+    vector<vector<float>> search_dist;
+    vector<Plane_Fit_Type> planes(query_cloud.size());
+    vector<PointType_CMP> neighbors;
+    double separate_time = 0.0, fused_time = 0.0;
+    for (int round = 0; round < Repeat_Time; round++){
+        auto t1 = chrono::high_resolution_clock::now();
+        tree.Nearest_Search_Batch(query_cloud, Nearest_Num, search_result, search_dist);
+        for (int i = 0; i < query_cloud.size(); i++){
+            neighbors.clear();
+            for (int j = 0; j < search_result[i].size(); j++) neighbors.push_back(PointType_CMP(search_result[i][j], search_dist[i][j]));
+            Fit_Plane(neighbors.data(), neighbors.size(), query_cloud[i], planes[i]);
+        }
+        auto t2 = chrono::high_resolution_clock::now();
+        tree.Nearest_Plane_Search_Batch(query_cloud, Nearest_Num, planes);
+        auto t3 = chrono::high_resolution_clock::now();
+        separate_time += chrono::duration_cast<chrono::microseconds>(t2-t1).count();
+        fused_time += chrono::duration_cast<chrono::microseconds>(t3-t2).count();
+    }
+    separate_time /= Repeat_Time;
+    fused_time /= Repeat_Time;
+    int valid_num = 0;
+    for (int i = 0; i < planes.size(); i++) valid_num += planes[i].valid;
+    printf("Plane fit (%d queries, k = %d, %d valid planes):\n", int(query_cloud.size()), Nearest_Num, valid_num);
+    printf("    Search, then fit: %0.3f ms, %0.0f queries/s\n", separate_time/1e3, query_cloud.size()/separate_time*1e6);
+    printf("    Fused:            %0.3f ms, %0.0f queries/s\n", fused_time/1e3, query_cloud.size()/fused_time*1e6);
+    printf("    Speedup:          %0.2fx\n", separate_time/fused_time);
+    return;
+}
+
+/*
+    Compare transforming a scan into a new cloud before the batch search with transforming it inside the search
+*/
+
+void benchmark_transform(KD_TREE & tree){
+    vector<PointVector> search_result;
+    vector<vector<float>> search_dist;
+    PointVector world_cloud;
+    Rigid_Transform_Type transform;
+    float yaw = 0.3f;
+    transform.rotation[0][0] = cos(yaw); transform.rotation[0][1] = -sin(yaw);
+    transform.rotation[1][0] = sin(yaw); transform.rotation[1][1] = cos(yaw);
+    transform.translation[0] = 1.5f; transform.translation[1] = -2.0f; transform.translation[2] = 0.1f;
+    double copy_time = 0.0, fused_time = 0.0;
+    for (int round = 0; round < Repeat_Time; round++){
+        auto t1 = chrono::high_resolution_clock::now();
+        world_cloud.resize(query_cloud.size());
+        for (int i = 0; i < query_cloud.size(); i++){
+            const PointType & p = query_cloud[i];
+            world_cloud[i] = p;
+            world_cloud[i].x = transform.rotation[0][0] * p.x + transform.rotation[0][1] * p.y + transform.rotation[0][2] * p.z + transform.translation[0];
+            world_cloud[i].y = transform.rotation[1][0] * p.x + transform.rotation[1][1] * p.y + transform.rotation[1][2] * p.z + transform.translation[1];
+            world_cloud[i].z = transform.rotation[2][0] * p.x + transform.rotation[2][1] * p.y + transform.rotation[2][2] * p.z + transform.translation[2];
+        }
+        tree.Nearest_Search_Batch(world_cloud, Nearest_Num, search_result, search_dist);
+        auto t2 = chrono::high_resolution_clock::now();
+        tree.Nearest_Search_Batch(query_cloud, transform, Nearest_Num, search_result, search_dist);
+        auto t3 = chrono::high_resolution_clock::now();
+        copy_time += chrono::duration_cast<chrono::microseconds>(t2-t1).count();
+        fused_time += chrono::duration_cast<chrono::microseconds>(t3-t2).count();
+    }
+    copy_time /= Repeat_Time;
+    fused_time /= Repeat_Time;
+    printf("Transformed scan (%d queries, k = %d):\n", int(query_cloud.size()), Nearest_Num);
+    printf("    Transformed copy: %0.3f ms, %0.0f queries/s\n", copy_time/1e3, query_cloud.size()/copy_time*1e6);
+    printf("    In the search:    %0.3f ms, %0.0f queries/s\n", fused_time/1e3, query_cloud.size()/fused_time*1e6);
+    printf("    Speedup:          %0.2fx\n", copy_time/fused_time);
+    return;
+}
+
+/*
+    Compare nearest search and updates with and without the voxel cache, for a few voxel sizes
+*/
+
+void benchmark_voxel_cache(KD_TREE & tree){
+    vector<PointVector> search_result;
+    vector<vector<float>> plain_dist, search_dist;
+    PointVector update_cloud;
+    const float voxel_sizes[4] = {0.0f, 0.5f, 1.0f, 2.0f};
+    printf("Voxel cache (%d queries, k = %d, %d points added and deleted per update):\n", int(query_cloud.size()), Nearest_Num, Voxel_Update_Point_Num);
+    for (int v = 0; v < 4; v++){
+        auto t0 = chrono::high_resolution_clock::now();
+        tree.Set_voxel_cache(voxel_sizes[v]);
+        auto t1 = chrono::high_resolution_clock::now();
+        tree.Reset_Stats();
+        double search_time = 0.0, update_time = 0.0;
+        for (int round = 0; round < Repeat_Time; round++){
+            auto t2 = chrono::high_resolution_clock::now();
+            tree.Nearest_Search_Batch(query_cloud, Nearest_Num, search_result, search_dist);
+            auto t3 = chrono::high_resolution_clock::now();
+            PointVector ().swap(update_cloud);
+            PointType new_point;
+            for (int i = 0; i < Voxel_Update_Point_Num; i++){
+                new_point.x = rand_float(X_MIN, X_MAX);
+                new_point.y = rand_float(Y_MIN, Y_MAX);
+                new_point.z = rand_float(Z_MIN, Z_MAX);
+                update_cloud.push_back(new_point);
+            }
+            auto t4 = chrono::high_resolution_clock::now();
+            tree.Add_Points(update_cloud, false);
+            tree.Delete_Points(update_cloud);
+            auto t5 = chrono::high_resolution_clock::now();
+            search_time += chrono::duration_cast<chrono::microseconds>(t3-t2).count();
+            update_time += chrono::duration_cast<chrono::microseconds>(t5-t4).count();
+        }
+        search_time /= Repeat_Time;
+        update_time /= Repeat_Time;
+        if (v == 0){
+            plain_dist = search_dist;
+            printf("    Tree only:   search %0.3f ms, %0.0f queries/s, update %0.3f ms\n", search_time/1e3, query_cloud.size()/search_time*1e6, update_time/1e3);
+            continue;
+        }
+        int mismatch_num = 0;
+        for (int i = 0; i < query_cloud.size(); i++) mismatch_num += search_dist[i] != plain_dist[i];
+        printf("    Voxel %0.1f m: search %0.3f ms, %0.0f queries/s, update %0.3f ms, cache built in %0.3f ms, %d mismatches",
+               voxel_sizes[v], search_time/1e3, query_cloud.size()/search_time*1e6, update_time/1e3, chrono::duration_cast<chrono::microseconds>(t1-t0).count()/1e3, mismatch_num);
+#if KD_TREE_STATS
+        Tree_Stats_Type stats = tree.Get_Stats();
+        printf(", %0.1f%% answered by the cache", 100.0 * stats.voxel_cache_hit_num / max(uint64_t(1), stats.voxel_cache_hit_num + stats.voxel_cache_miss_num));
+#endif
+        printf("\n");
+    }
+    tree.Set_voxel_cache(0.0f);
+    return;
+}
+
+/*
+    Per frame, add and delete a scan then search: synchronously, or queued to the async writer thread so
+    that the search of the frame runs while the update is applied
+*/
+
+void benchmark_async(KD_TREE & tree){
+    vector<PointVector> search_result;
+    vector<vector<float>> search_dist;
+    PointVector update_cloud;
+    printf("Async updates (%d queries, k = %d, %d points added and deleted per frame):\n", int(query_cloud.size()), Nearest_Num, Async_Update_Point_Num);
+    for (int mode = 0; mode < 2; mode++){
+        double update_time = 0.0, frame_time = 0.0;
+        uint64_t sequence = 0;
+        for (int round = 0; round < Repeat_Time; round++){
+            PointVector ().swap(update_cloud);
+            PointType new_point;
+            for (int i = 0; i < Async_Update_Point_Num; i++){
+                new_point.x = rand_float(X_MIN, X_MAX);
+                new_point.y = rand_float(Y_MIN, Y_MAX);
+                new_point.z = rand_float(Z_MIN, Z_MAX);
+                update_cloud.push_back(new_point);
+            }
+            auto t1 = chrono::high_resolution_clock::now();
+            if (mode == 0){
+                tree.Add_Points(update_cloud, false);
+                tree.Delete_Points(update_cloud);
+            } else {
+                tree.Add_Points_Async(update_cloud, false);
+                sequence = tree.Delete_Points_Async(update_cloud);
+            }
+            auto t2 = chrono::high_resolution_clock::now();
+            tree.Nearest_Search_Batch(query_cloud, Nearest_Num, search_result, search_dist);
+            auto t3 = chrono::high_resolution_clock::now();
+            update_time += chrono::duration_cast<chrono::microseconds>(t2-t1).count();
+            frame_time += chrono::duration_cast<chrono::microseconds>(t3-t1).count();
+        }
+        auto t4 = chrono::high_resolution_clock::now();
+        tree.Wait_For_Sequence(sequence);
+        auto t5 = chrono::high_resolution_clock::now();
+        update_time /= Repeat_Time;
+        frame_time /= Repeat_Time;
+        if (mode == 0){
+            printf("    Synchronous: update %0.3f ms, frame %0.3f ms\n", update_time/1e3, frame_time/1e3);
+        } else {
+            printf("    Async:       update %0.3f ms, frame %0.3f ms, %0.3f ms to drain the queue\n", update_time/1e3, frame_time/1e3,
+                   chrono::duration_cast<chrono::microseconds>(t5-t4).count()/1e3);
+        }
+    }
+    return;
+}
+
+/*
+    Print the statistics collected when built with KD_TREE_STATS; percentiles are bucket upper bounds
+*/
+
+float histogram_percentile_us(const Stats_Histogram_Type & histogram, double percentile){
+    uint64_t rank = uint64_t(histogram.count * percentile), seen = 0;
+    for (int i = 0; i < Stats_Bucket_Num; i++){
+        seen += histogram.bucket[i];
+        if (seen > rank) return float(1u << i);
+    }
+    return float(1u << (Stats_Bucket_Num - 1));
+}
+
+void print_tree_stats(KD_TREE & tree){
+    const char * operation_names[STATS_OPERATION_NUM] = {"Build", "Add_Points", "Delete_Points", "Add_Point_Boxes", "Delete_Point_Boxes",
+            "Add_Point_Regions", "Delete_Point_Regions", "Nearest_Search", "Box_Search", "Region_Search"};
+    const char * lock_names[STATS_LOCK_NUM] = {"search read", "search write", "working flag"};
+    Tree_Stats_Type stats = tree.Get_Stats();
+    printf("Tree stats (size %d, valid %d, tombstones %0.1f%%, logger depth %d, max %d):\n", stats.tree_size, stats.valid_num,
+            stats.tombstone_ratio * 100.0, stats.logger_depth, stats.logger_max_depth);
+    for (int i = 0; i < STATS_OPERATION_NUM; i++){
+        Stats_Histogram_Type & histogram = stats.operation[i];
+        if (histogram.count == 0) continue;
+        printf("    %-20s %10llu calls, mean %0.2f us, p50 < %0.0f us, p99 < %0.0f us, max %0.2f us, %0.1f nodes/call\n", operation_names[i],
+                (unsigned long long) histogram.count, histogram.total_ns / 1e3 / histogram.count, histogram_percentile_us(histogram, 0.5),
+                histogram_percentile_us(histogram, 0.99), histogram.max_ns / 1e3, double(stats.node_visited[i]) / histogram.count);
+    }
+    for (int i = 0; i < STATS_LOCK_NUM; i++){
+        printf("    %-20s lock %10llu acquired, %llu waited, %0.3f ms waiting\n", lock_names[i], (unsigned long long) stats.lock_acquired[i],
+                (unsigned long long) stats.lock_wait[i].count, stats.lock_wait[i].total_ns / 1e6);
+    }
+    printf("    Rebuilds: %llu in background (%llu points, largest %llu, %0.3f ms), %llu by the writer (%llu points)\n",
+            (unsigned long long) stats.rebuild.count, (unsigned long long) stats.rebuild_point_num, (unsigned long long) stats.rebuild_max_point_num,
+            stats.rebuild.total_ns / 1e6, (unsigned long long) stats.writer_rebuild_num, (unsigned long long) stats.writer_rebuild_point_num);
+    if (stats.voxel_cache_hit_num + stats.voxel_cache_miss_num > 0){
+        printf("    Voxel cache: %llu searches answered, %llu fell back to the tree\n", (unsigned long long) stats.voxel_cache_hit_num, (unsigned long long) stats.voxel_cache_miss_num);
+    }
+    return;
+}
+
+/*
+    Compare one tree with a tiled forest on a large outdoor map: build, scan ingest and batched search.
+    The paged forest keeps Forest_Resident_Point_Num points in memory and prefetches along the drive.
+*/
+
+void generate_outdoor_cloud(PointVector & cloud, int num, float center_x, float center_y, float radius){
+    PointVector ().swap(cloud);
+    PointType new_point;
+    for (int i = 0; i < num; i++){
+        new_point.x = center_x + rand_float(-radius, radius);
+        new_point.y = center_y + rand_float(-radius, radius);
+        new_point.z = rand_float(Z_MIN, Z_MAX);
+        cloud.push_back(new_point);
+    }
+    return;
+}
+
+void benchmark_forest(int map_num, int query_num){
+    PointVector scan;
+    vector<PointVector> scans;
+    vector<PointVector> search_result;
+    vector<vector<float>> search_dist;
+    generate_outdoor_cloud(map_cloud, map_num, 0.0, 0.0, Forest_Map_Range);
+    generate_outdoor_cloud(query_cloud, query_num, 0.0, 0.0, Forest_Map_Range);
+    // Scans along a straight drive through the map
+    for (int i = 0; i < Forest_Scan_Num; i++){
+        generate_outdoor_cloud(scan, Forest_Scan_Point_Num, -Forest_Map_Range + 2.0 * Forest_Map_Range * i / Forest_Scan_Num, 0.0, 60.0);
+        scans.push_back(scan);
+    }
+    printf("Forest (%d map points, %d scans of %d points, %d queries, k = %d):\n", map_num, Forest_Scan_Num, Forest_Scan_Point_Num, query_num, Nearest_Num);
+    const char * names[3] = {"Tree  ", "Forest", "Paged "};
+    char paging_directory[] = "/tmp/ikd_forest_XXXXXX";
+    for (int use_forest = 0; use_forest < 3; use_forest++){
+        KD_TREE * tree = nullptr;
+        KD_FOREST * forest = nullptr;
+        if (use_forest) forest = new KD_FOREST(Forest_Tile_Size, 0.3, 0.6, 0.2);
+            else tree = new KD_TREE(0.3, 0.6, 0.2);
+        if (use_forest == 2){
+            if (mkdtemp(paging_directory) == nullptr) break;
+            forest->Set_paging(paging_directory, Forest_Resident_Point_Num);
+        }
+        auto t1 = chrono::high_resolution_clock::now();
+        if (use_forest) forest->Build(map_cloud);
+            else tree->Build(map_cloud);
+        auto t2 = chrono::high_resolution_clock::now();
+        for (int i = 0; i < Forest_Scan_Num; i++){
+            if (use_forest){
+                PointType position;
+                position.x = -Forest_Map_Range + 2.0 * Forest_Map_Range * i / Forest_Scan_Num;
+                position.y = 0.0;
+                position.z = 0.0;
+                forest->Update_Position(position);
+                forest->Add_Points(scans[i], false);
+            } else {
+                tree->Add_Points(scans[i], false);
+            }
+        }
+        auto t3 = chrono::high_resolution_clock::now();
+        if (use_forest) forest->Nearest_Search_Batch(query_cloud, Nearest_Num, search_result, search_dist);
+            else tree->Nearest_Search_Batch(query_cloud, Nearest_Num, search_result, search_dist);
+        auto t4 = chrono::high_resolution_clock::now();
+        double build_time = chrono::duration_cast<chrono::microseconds>(t2-t1).count();
+        double add_time = chrono::duration_cast<chrono::microseconds>(t3-t2).count();
+        double search_time = chrono::duration_cast<chrono::microseconds>(t4-t3).count();
+        printf("    %s: build %0.3f ms, ingest %0.0f points/s, search %0.0f queries/s\n", names[use_forest],
+                build_time/1e3, Forest_Scan_Num * Forest_Scan_Point_Num / add_time * 1e6, query_cloud.size() / search_time * 1e6);
+        delete tree;
+        delete forest;
+    }
+    rmdir(paging_directory);
+    return;
+}
+
+/*
+    Benchmark suite: fixed seeds, several workloads and a sweep over map size, k, batch size and
+    thread count. Every operation call is timed and summarised into one CSV or JSON row.
+*/
+
+enum suite_workload_set {WORKLOAD_UNIFORM, WORKLOAD_LIDAR, WORKLOAD_CLUSTERED, WORKLOAD_PLANAR, WORKLOAD_NUM};
+
+const char * workload_names[WORKLOAD_NUM] = {"uniform", "lidar", "clustered", "planar"};
+
+struct Suite_Result_Type{
+    const char * workload;
+    int map_size;
+    const char * operation;
+    int k_nearest = 0, batch_size = 0, thread_num = 1;
+    vector<double> latency_us;
+    double wall_us = 0.0;
+};
+
+vector<Suite_Result_Type> suite_results;
+
+/*
+    One ring scanner sweep at step along a winding street: a ground plane, two facades and the poles along them
+*/
+
+void generate_lidar_scan(PointVector & cloud, int step){
+    float sensor_x = step * Lidar_Step_Length, sensor_y = 2.0 * sin(step * 0.1), sensor_z = 1.8;
+    PointType new_point;
+    for (int ring = 0; ring < Lidar_Ring_Num; ring++){
+        float elevation = (-15.0 + 30.0 * ring / (Lidar_Ring_Num - 1)) * M_PI / 180.0;
+        for (int i = 0; i < Lidar_Ring_Point_Num; i++){
+            float azimuth = 2.0 * M_PI * i / Lidar_Ring_Point_Num;
+            float dx = cos(elevation) * cos(azimuth), dy = cos(elevation) * sin(azimuth), dz = sin(elevation);
+            float range = Lidar_Max_Range;
+            if (dz < 0) range = min(range, -sensor_z / dz);
+            if (dy > 0) range = min(range, float((Street_Half_Width - sensor_y) / dy));
+            if (dy < 0) range = min(range, float((-Street_Half_Width - sensor_y) / dy));
+            // Poles every 10 m along both facades, 0.3 m wide
+            for (float pole_y = -Street_Half_Width + 1.0; pole_y < Street_Half_Width; pole_y += 2.0 * Street_Half_Width - 2.0){
+                if (fabs(dy) < 1e-3) continue;
+                float t = (pole_y - sensor_y) / dy;
+                if (t <= 0 || t >= range) continue;
+                float hit_x = sensor_x + t * dx;
+                if (fabs(hit_x - 10.0 * roundf(hit_x / 10.0)) < 0.15) range = t;
+            }
+            if (range >= Lidar_Max_Range) continue;
+            range += rand_float(-0.02, 0.02);
+            new_point.x = sensor_x + range * dx;
+            new_point.y = sensor_y + range * dy;
+            new_point.z = sensor_z + range * dz;
+            cloud.push_back(new_point);
+        }
+    }
+    return;
+}
+
+/*
+    num points of a workload; step moves the sensor of the lidar workload and the centre of the others
+*/
+
+void generate_workload(PointVector & cloud, int workload, int num, int step){
+    PointVector ().swap(cloud);
+    cloud.reserve(num);
+    PointType new_point;
+    float offset = step * Lidar_Step_Length;
+    switch (workload)
+    {
+    case WORKLOAD_LIDAR:
+        while (int(cloud.size()) < num) generate_lidar_scan(cloud, step++);
+        cloud.resize(num);
+        break;
+    case WORKLOAD_CLUSTERED:
+        {
+            // Gaussian blobs whose centres only depend on the seed, so batches fall on the same clusters
+            mt19937 cluster_rng(Random_Seed);
+            uniform_real_distribution<float> center_x(X_MIN, X_MAX), center_y(Y_MIN, Y_MAX), center_z(Z_MIN, Z_MAX);
+            vector<PointType> centers(Cluster_Num);
+            for (int i = 0; i < Cluster_Num; i++){
+                centers[i].x = center_x(cluster_rng);
+                centers[i].y = center_y(cluster_rng);
+                centers[i].z = center_z(cluster_rng);
+            }
+            normal_distribution<float> spread(0.0, Cluster_Sigma);
+            for (int i = 0; i < num; i++){
+                PointType & center = centers[rng() % Cluster_Num];
+                new_point.x = center.x + spread(rng) + offset;
+                new_point.y = center.y + spread(rng);
+                new_point.z = center.z + spread(rng);
+                cloud.push_back(new_point);
+            }
+        }
+        break;
+    case WORKLOAD_PLANAR:
+        // Degenerate input: a floor and two walls, on a 5 cm grid so that many points share coordinates
+        for (int i = 0; i < num; i++){
+            float u = roundf(rand_float(X_MIN, X_MAX) * 20.0) / 20.0 + offset, v = roundf(rand_float(Y_MIN, Y_MAX) * 20.0) / 20.0;
+            int plane = rng() % 3;
+            new_point.x = u;
+            new_point.y = (plane == 1) ? Y_MIN : ((plane == 2) ? Y_MAX : v);
+            new_point.z = (plane == 0) ? Z_MIN : roundf(rand_float(Z_MIN, Z_MAX) * 20.0) / 20.0;
+            cloud.push_back(new_point);
+        }
+        break;
+    default:
+        for (int i = 0; i < num; i++){
+            new_point.x = rand_float(X_MIN, X_MAX) + offset;
+            new_point.y = rand_float(Y_MIN, Y_MAX);
+            new_point.z = rand_float(Z_MIN, Z_MAX);
+            cloud.push_back(new_point);
+        }
+        break;
+    }
+    return;
+}
+
+/*
+    Run task_num calls split between thread_num threads, the calling thread included, and time each call
+*/
+
+struct Suite_Thread_Arg{
+    const function<void(int)> * run;
+    int task_begin, task_end;
+    vector<double> latency_us;
+};
+
+void * suite_thread_ptr(void * arg){
+    Suite_Thread_Arg * thread_arg = (Suite_Thread_Arg *) arg;
+    for (int i = thread_arg->task_begin; i < thread_arg->task_end; i++){
+        auto t1 = chrono::high_resolution_clock::now();
+        (*thread_arg->run)(i);
+        auto t2 = chrono::high_resolution_clock::now();
+        thread_arg->latency_us.push_back(chrono::duration_cast<chrono::nanoseconds>(t2-t1).count() / 1e3);
+    }
+    return nullptr;
+}
+
+void run_timed(Suite_Result_Type & result, int task_num, const function<void(int)> & run){
+    int thread_num = max(1, result.thread_num);
+    vector<pthread_t> threads(thread_num);
+    vector<Suite_Thread_Arg> thread_args(thread_num);
+    for (int i = 0; i < thread_num; i++){
+        thread_args[i].run = &run;
+        thread_args[i].task_begin = int(int64_t(task_num) * i / thread_num);
+        thread_args[i].task_end = int(int64_t(task_num) * (i + 1) / thread_num);
+        thread_args[i].latency_us.reserve(thread_args[i].task_end - thread_args[i].task_begin);
+    }
+    auto t1 = chrono::high_resolution_clock::now();
+    for (int i = 1; i < thread_num; i++) pthread_create(&threads[i], NULL, suite_thread_ptr, (void*) &thread_args[i]);
+    suite_thread_ptr((void*) &thread_args[0]);
+    for (int i = 1; i < thread_num; i++) pthread_join(threads[i], NULL);
+    auto t2 = chrono::high_resolution_clock::now();
+    result.wall_us = chrono::duration_cast<chrono::nanoseconds>(t2-t1).count() / 1e3;
+    for (int i = 0; i < thread_num; i++) result.latency_us.insert(result.latency_us.end(), thread_args[i].latency_us.begin(), thread_args[i].latency_us.end());
+    suite_results.push_back(result);
+    fprintf(stderr, "    %-10s %8d %-18s k %2d batch %6d threads %d: %0.3f ms\n", result.workload, result.map_size, result.operation,
+            result.k_nearest, result.batch_size, result.thread_num, result.wall_us / 1e3);
+    return;
+}
+
+void benchmark_suite_case(int workload, int map_size, bool quick){
+    const int k_values[3] = {1, 5, 10};
+    const int thread_values[3] = {1, 2, 4};
+    const int batch_values[2] = {1000, 10000};
+    int query_num = quick ? Suite_Quick_Query_Num : Suite_Query_Num;
+    int step = 0;
+    rng.seed(Random_Seed + workload * 1000 + map_size / 1000);
+    Suite_Result_Type result;
+    result.workload = workload_names[workload];
+    result.map_size = map_size;
+    KD_TREE tree(0.3, 0.6, 0.2);
+    generate_workload(map_cloud, workload, map_size, step);
+    // The lidar map is built from the first scans and queried with the following ones
+    step += map_size / (Lidar_Ring_Num * Lidar_Ring_Point_Num) + 1;
+    generate_workload(query_cloud, workload, query_num, step);
+    result.operation = "build";
+    run_timed(result, 1, [&](int){
+        tree.Build(map_cloud);
+    });
+    vector<PointVector> nearest_points(query_num);
+    vector<vector<float>> nearest_dist(query_num);
+    for (int k_index = 0; k_index < 3; k_index++){
+        for (int thread_index = 0; thread_index < 3; thread_index++){
+            result = Suite_Result_Type();
+            result.workload = workload_names[workload];
+            result.map_size = map_size;
+            result.operation = "nearest_search";
+            result.k_nearest = k_values[k_index];
+            result.thread_num = thread_values[thread_index];
+            run_timed(result, query_num, [&](int i){
+                tree.Nearest_Search(query_cloud[i], k_values[k_index], nearest_points[i], nearest_dist[i]);
+            });
+        }
+    }
+    vector<BoxPointType> boxes(Suite_Box_Num);
+    for (int i = 0; i < Suite_Box_Num; i++){
+        PointType & center = query_cloud[i % query_num];
+        boxes[i].vertex_min[0] = center.x - Suite_Box_Length / 2; boxes[i].vertex_max[0] = center.x + Suite_Box_Length / 2;
+        boxes[i].vertex_min[1] = center.y - Suite_Box_Length / 2; boxes[i].vertex_max[1] = center.y + Suite_Box_Length / 2;
+        boxes[i].vertex_min[2] = center.z - Suite_Box_Length / 2; boxes[i].vertex_max[2] = center.z + Suite_Box_Length / 2;
+    }
+    for (int thread_index = 0; thread_index < 3; thread_index++){
+        result = Suite_Result_Type();
+        result.workload = workload_names[workload];
+        result.map_size = map_size;
+        result.operation = "box_search";
+        result.thread_num = thread_values[thread_index];
+        vector<PointVector> box_points(Suite_Box_Num);
+        run_timed(result, Suite_Box_Num, [&](int i){
+            tree.Box_Search(boxes[i], box_points[i]);
+        });
+    }
+    for (int batch_index = 0; batch_index < 2; batch_index++){
+        int batch_size = batch_values[batch_index];
+        vector<PointVector> batches(Suite_Batch_Repeat);
+        for (int i = 0; i < Suite_Batch_Repeat; i++){
+            generate_workload(batches[i], workload, batch_size, step);
+            step += batch_size / (Lidar_Ring_Num * Lidar_Ring_Point_Num) + 1;
+        }
+        result = Suite_Result_Type();
+        result.workload = workload_names[workload];
+        result.map_size = map_size;
+        result.operation = "add_points";
+        result.batch_size = batch_size;
+        run_timed(result, Suite_Batch_Repeat, [&](int i){
+            tree.Add_Points(batches[i], false);
+        });
+        result.operation = "delete_points";
+        result.latency_us.clear();
+        run_timed(result, Suite_Batch_Repeat, [&](int i){
+            tree.Delete_Points(batches[i]);
+        });
+    }
+    result = Suite_Result_Type();
+    result.workload = workload_names[workload];
+    result.map_size = map_size;
+    result.operation = "delete_point_boxes";
+    result.batch_size = 1;
+    run_timed(result, Suite_Box_Num, [&](int i){
+        vector<BoxPointType> box(1, boxes[i]);
+        tree.Delete_Point_Boxes(box);
+    });
+    return;
+}
+
+double latency_percentile(vector<double> & sorted_latency, double percentile){
+    if (sorted_latency.empty()) return 0.0;
+    int index = min(int(sorted_latency.size()) - 1, int(sorted_latency.size() * percentile));
+    return sorted_latency[index];
+}
+
+void write_suite_results(FILE * fp, bool json){
+    if (json){
+        fprintf(fp, "[\n");
+    } else {
+        fprintf(fp, "workload,map_size,operation,k,batch_size,threads,calls,mean_us,p50_us,p99_us,max_us,calls_per_s\n");
+    }
+    for (int i = 0; i < suite_results.size(); i++){
+        Suite_Result_Type & result = suite_results[i];
+        vector<double> & latency = result.latency_us;
+        sort(latency.begin(), latency.end());
+        double mean_us = 0.0;
+        for (int j = 0; j < latency.size(); j++) mean_us += latency[j];
+        if (!latency.empty()) mean_us /= latency.size();
+        double max_us = latency.empty() ? 0.0 : latency.back();
+        double calls_per_s = result.wall_us > 0 ? latency.size() / result.wall_us * 1e6 : 0.0;
+        if (json){
+            fprintf(fp, "  {\"workload\": \"%s\", \"map_size\": %d, \"operation\": \"%s\", \"k\": %d, \"batch_size\": %d, \"threads\": %d, "
+                    "\"calls\": %d, \"mean_us\": %0.3f, \"p50_us\": %0.3f, \"p99_us\": %0.3f, \"max_us\": %0.3f, \"calls_per_s\": %0.1f}%s\n",
+                    result.workload, result.map_size, result.operation, result.k_nearest, result.batch_size, result.thread_num, int(latency.size()),
+                    mean_us, latency_percentile(latency, 0.5), latency_percentile(latency, 0.99), max_us, calls_per_s, (i + 1 < suite_results.size()) ? "," : "");
+        } else {
+            fprintf(fp, "%s,%d,%s,%d,%d,%d,%d,%0.3f,%0.3f,%0.3f,%0.3f,%0.1f\n", result.workload, result.map_size, result.operation,
+                    result.k_nearest, result.batch_size, result.thread_num, int(latency.size()), mean_us, latency_percentile(latency, 0.5),
+                    latency_percentile(latency, 0.99), max_us, calls_per_s);
+        }
+    }
+    if (json) fprintf(fp, "]\n");
+    return;
+}
+
+int benchmark_suite(const char * output_file, bool quick){
+    const int map_sizes[2] = {Suite_Small_Map_Num, Suite_Large_Map_Num};
+    int map_size_num = quick ? 1 : 2;
+    const char * extension = strrchr(output_file, '.');
+    bool json = extension != nullptr && strcmp(extension, ".json") == 0;
+    FILE * fp = fopen(output_file, "w");
+    if (fp == nullptr){
+        fprintf(stderr, "Cannot open %s\n", output_file);
+        return 1;
+    }
+    fprintf(stderr, "Benchmark suite (seed %d), results in %s:\n", Random_Seed, output_file);
+    for (int workload = 0; workload < WORKLOAD_NUM; workload++){
+        for (int i = 0; i < map_size_num; i++) benchmark_suite_case(workload, quick ? Suite_Quick_Map_Num : map_sizes[i], quick);
+    }
+    write_suite_results(fp, json);
+    fclose(fp);
+    return 0;
+}
+
+/*
+    Stress harness: a long random interleaving of updates and searches on one tree, with its rebuild
+    thread running. Every result is checked against a flat reference of the live points, and a
+    verifier thread searches snapshots concurrently with the updates. Hardware counters are read
+    around each call when perf events are accessible.
+*/
+
+enum stress_operation_set {STRESS_ADD_POINTS, STRESS_DOWNSAMPLE_ADD_POINTS, STRESS_DELETE_POINTS, STRESS_DELETE_BOXES, STRESS_ADD_BOXES,
+        STRESS_DELETE_REGIONS, STRESS_NEAREST_SEARCH, STRESS_BOX_SEARCH, STRESS_REGION_SEARCH, STRESS_OPERATION_NUM};
+
+enum stress_check_set {CHECK_NEAREST, CHECK_BOX, CHECK_REGION, CHECK_REVIVE, CHECK_VALIDNUM, CHECK_SNAPSHOT, CHECK_NUM};
+
+const char * stress_operation_names[STRESS_OPERATION_NUM] = {"Add_Points", "Add_Points (downsample)", "Delete_Points", "Delete_Point_Boxes",
+        "Add_Point_Boxes", "Delete_Point_Regions", "Nearest_Search", "Box_Search", "Region_Search"};
+const char * stress_check_names[CHECK_NUM] = {"nearest", "box", "region", "revive", "validnum", "snapshot"};
+
+struct Stress_Operation_Stats{
+    long long calls = 0;
+    double time_us = 0.0;
+    long long cache_misses = 0, branch_misses = 0;
+};
+
+Stress_Operation_Stats stress_stats[STRESS_OPERATION_NUM];
+long long stress_checks[CHECK_NUM], stress_mismatches[CHECK_NUM];
+Perf_Counter * stress_cache_misses = nullptr;
+Perf_Counter * stress_branch_misses = nullptr;
+
+// Live points with the position of each id, and the deleted points a box may revive
+PointVector stress_live;
+unordered_map<uint32_t, int> stress_live_index;
+unordered_map<uint32_t, PointType> stress_dead;
+
+void stress_add_live(const PointType & point){
+    stress_live_index[point.id] = stress_live.size();
+    stress_live.push_back(point);
+    stress_dead.erase(point.id);
+    return;
+}
+
+void stress_remove_live(uint32_t id){
+    auto iter = stress_live_index.find(id);
+    if (iter == stress_live_index.end()) return;
+    int index = iter->second;
+    stress_dead[id] = stress_live[index];
+    stress_live[index] = stress_live.back();
+    stress_live_index[stress_live[index].id] = index;
+    stress_live.pop_back();
+    stress_live_index.erase(id);
+    return;
+}
+
+template<typename Operation> void stress_run(int op, Operation operation){
+    if (stress_cache_misses->fd >= 0) stress_cache_misses->start();
+    if (stress_branch_misses->fd >= 0) stress_branch_misses->start();
+    auto t1 = chrono::high_resolution_clock::now();
+    operation();
+    auto t2 = chrono::high_resolution_clock::now();
+    if (stress_branch_misses->fd >= 0) stress_stats[op].branch_misses += stress_branch_misses->stop();
+    if (stress_cache_misses->fd >= 0) stress_stats[op].cache_misses += stress_cache_misses->stop();
+    stress_stats[op].calls++;
+    stress_stats[op].time_us += chrono::duration_cast<chrono::nanoseconds>(t2-t1).count() / 1e3;
+    return;
+}
+
+// Same tolerance as the tree's box operations
+bool stress_in_box(const PointType & point, const BoxPointType & box){
+    return box.vertex_min[0] - EPSS < point.x && box.vertex_max[0] + EPSS > point.x && box.vertex_min[1] - EPSS < point.y && box.vertex_max[1] + EPSS > point.y
+            && box.vertex_min[2] - EPSS < point.z && box.vertex_max[2] + EPSS > point.z;
+}
+
+bool stress_in_sphere(const PointType & point, const PointType & center, float radius){
+    float dx = point.x - center.x, dy = point.y - center.y, dz = point.z - center.z;
+    return dx * dx + dy * dy + dz * dz <= radius * radius + EPSS;
+}
+
+PointType stress_random_point(mt19937 & generator){
+    uniform_real_distribution<float> x(X_MIN, X_MAX), y(Y_MIN, Y_MAX), z(Z_MIN, Z_MAX);
+    PointType point;
+    point.x = x(generator);
+    point.y = y(generator);
+    point.z = z(generator);
+    return point;
+}
+
+BoxPointType stress_random_box(mt19937 & generator){
+    PointType center = stress_random_point(generator);
+    float half_length = uniform_real_distribution<float>(0.5, 0.5 * Stress_Box_Length)(generator);
+    BoxPointType box;
+    box.vertex_min[0] = center.x - half_length; box.vertex_max[0] = center.x + half_length;
+    box.vertex_min[1] = center.y - half_length; box.vertex_max[1] = center.y + half_length;
+    box.vertex_min[2] = center.z - half_length; box.vertex_max[2] = center.z + half_length;
+    return box;
+}
+
+// Distances of the k nearest reference points
+bool stress_check_nearest(const PointVector & reference, PointType query, int k_nearest, const PointVector & result, const vector<float> & result_dist){
+    vector<float> dist(reference.size());
+    for (int i = 0; i < reference.size(); i++){
+        float dx = reference[i].x - query.x, dy = reference[i].y - query.y, dz = reference[i].z - query.z;
+        dist[i] = dx * dx + dy * dy + dz * dz;
+    }
+    int k_found = min(k_nearest, int(dist.size()));
+    partial_sort(dist.begin(), dist.begin() + k_found, dist.end());
+    if (int(result.size()) != k_found || int(result_dist.size()) != k_found) return false;
+    for (int i = 0; i < k_found; i++){
+        if (fabs(result_dist[i] - dist[i]) > 1e-6 * (1.0 + dist[i])) return false;
+    }
+    return true;
+}
+
+bool stress_same_ids(PointVector & result, PointVector & expected){
+    if (result.size() != expected.size()) return false;
+    vector<uint32_t> result_ids, expected_ids;
+    for (int i = 0; i < result.size(); i++) result_ids.push_back(result[i].id);
+    for (int i = 0; i < expected.size(); i++) expected_ids.push_back(expected[i].id);
+    sort(result_ids.begin(), result_ids.end());
+    sort(expected_ids.begin(), expected_ids.end());
+    return result_ids == expected_ids;
+}
+
+/*
+    The verifier thread checks a snapshot against the reference copied when it was taken
+*/
+
+struct Stress_Verifier_Type{
+    pthread_mutex_t mutex;
+    pthread_cond_t signal;
+    shared_ptr<KD_TREE_SNAPSHOT> snapshot;
+    PointVector reference;
+    bool pending = false, done = false, stop = false;
+    unsigned seed = 0;
+    long long checks = 0, mismatches = 0;
+};
+
+void * stress_verifier_ptr(void * arg){
+    Stress_Verifier_Type * verifier = (Stress_Verifier_Type *) arg;
+    PointVector result, expected;
+    vector<float> result_dist;
+    pthread_mutex_lock(&verifier->mutex);
+    while (true){
+        while (!verifier->pending && !verifier->stop) pthread_cond_wait(&verifier->signal, &verifier->mutex);
+        if (verifier->stop) break;
+        pthread_mutex_unlock(&verifier->mutex);
+        // The job is not touched by the writer until done is set
+        mt19937 generator(verifier->seed);
+        long long checks = 0, mismatches = 0;
+        for (int i = 0; i < Stress_Query_Num; i++){
+            PointType query = stress_random_point(generator);
+            int k_nearest = 1 + generator() % Stress_Max_Nearest_Num;
+            verifier->snapshot->Nearest_Search(query, k_nearest, result, result_dist);
+            checks++;
+            if (!stress_check_nearest(verifier->reference, query, k_nearest, result, result_dist)) mismatches++;
+        }
+        BoxPointType box = stress_random_box(generator);
+        verifier->snapshot->Box_Search(box, result);
+        PointVector ().swap(expected);
+        for (int i = 0; i < verifier->reference.size(); i++){
+            if (stress_in_box(verifier->reference[i], box)) expected.push_back(verifier->reference[i]);
+        }
+        checks++;
+        if (!stress_same_ids(result, expected)) mismatches++;
+        pthread_mutex_lock(&verifier->mutex);
+        verifier->checks += checks;
+        verifier->mismatches += mismatches;
+        verifier->pending = false;
+        verifier->done = true;
+    }
+    pthread_mutex_unlock(&verifier->mutex);
+    return nullptr;
+}
+
+int benchmark_stress(int iteration_num, unsigned seed, const char * trace_file){
+    rng.seed(seed);
+    Perf_Counter cache_misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    Perf_Counter branch_misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    stress_cache_misses = &cache_misses;
+    stress_branch_misses = &branch_misses;
+    memset(stress_checks, 0, sizeof(stress_checks));
+    memset(stress_mismatches, 0, sizeof(stress_mismatches));
+    // Low criteria so that subtrees are rebuilt often, in the background for the large ones
+    KD_TREE tree(0.3, 0.6, 0.2);
+    PointVector points, result, expected;
+    vector<float> result_dist;
+    for (int i = 0; i < Stress_Map_Point_Num; i++) points.push_back(stress_random_point(rng));
+    if (trace_file != nullptr && !tree.Start_Trace(trace_file)) fprintf(stderr, "Cannot open %s\n", trace_file);
+    tree.Build(points);
+    tree.Box_Search(BoxPointType{{X_MIN - 1, Y_MIN - 1, Z_MIN - 1}, {X_MAX + 1, Y_MAX + 1, Z_MAX + 1}}, points);
+    for (int i = 0; i < points.size(); i++) stress_add_live(points[i]);
+    Stress_Verifier_Type verifier;
+    pthread_mutex_init(&verifier.mutex, NULL);
+    pthread_cond_init(&verifier.signal, NULL);
+    pthread_t verifier_thread;
+    pthread_create(&verifier_thread, NULL, stress_verifier_ptr, (void*) &verifier);
+    for (int iter = 0; iter < iteration_num; iter++){
+        int op = rng() % STRESS_OPERATION_NUM;
+        switch (op)
+        {
+        case STRESS_ADD_POINTS:
+        case STRESS_DOWNSAMPLE_ADD_POINTS:
+            {
+                // Some batches are larger than Multi_Thread_Rebuild_Point_Num; while the tree is small they are also larger
+                // than ForceRebuildPercentage of it and take the batch insertion path
+                int batch_size = (rng() % 8 == 0) ? Multi_Thread_Rebuild_Point_Num + rng() % 3000 : 1 + rng() % 500;
+                PointVector ().swap(points);
+                for (int i = 0; i < batch_size; i++) points.push_back(stress_random_point(rng));
+                stress_run(op, [&](){
+                    tree.Add_Points(points, op == STRESS_DOWNSAMPLE_ADD_POINTS);
+                });
+                for (int i = 0; i < points.size(); i++) stress_add_live(points[i]);
+            }
+            break;
+        case STRESS_DELETE_POINTS:
+            {
+                int delete_num = min(int(stress_live.size()), 1 + int(rng() % 2000));
+                PointVector ().swap(points);
+                for (int i = 0; i < delete_num; i++) points.push_back(stress_live[rng() % stress_live.size()]);
+                // Half of the calls delete by position only
+                if (rng() % 2) for (int i = 0; i < points.size(); i++) points[i].id = Invalid_Point_ID;
+                stress_run(op, [&](){
+                    tree.Delete_Points(points);
+                });
+                for (int i = 0; i < delete_num; i++){
+                    if (points[i].id != Invalid_Point_ID){
+                        stress_remove_live(points[i].id);
+                        continue;
+                    }
+                    for (int j = 0; j < stress_live.size(); j++){
+                        if (stress_live[j].x == points[i].x && stress_live[j].y == points[i].y && stress_live[j].z == points[i].z){
+                            stress_remove_live(stress_live[j].id);
+                            break;
+                        }
+                    }
+                }
+            }
+            break;
+        case STRESS_DELETE_BOXES:
+        case STRESS_ADD_BOXES:
+            {
+                vector<BoxPointType> boxes(1, stress_random_box(rng));
+                PointVector revived_points;
+                int revived_num = 0;
+                stress_run(op, [&](){
+                    if (op == STRESS_DELETE_BOXES) tree.Delete_Point_Boxes(boxes);
+                        else revived_num = tree.Add_Point_Boxes(boxes, &revived_points);
+                });
+                if (op == STRESS_DELETE_BOXES){
+                    PointVector ().swap(expected);
+                    for (int i = 0; i < stress_live.size(); i++){
+                        if (stress_in_box(stress_live[i], boxes[0])) expected.push_back(stress_live[i]);
+                    }
+                    for (int i = 0; i < expected.size(); i++) stress_remove_live(expected[i].id);
+                    break;
+                }
+                // Deleted points come back unless a rebuild has already dropped them: every revived point
+                // was deleted inside the box, and the box then holds exactly the live points
+                bool valid = (revived_num == int(revived_points.size()));
+                for (int i = 0; i < revived_points.size(); i++){
+                    auto iter = stress_dead.find(revived_points[i].id);
+                    if (iter == stress_dead.end() || !stress_in_box(iter->second, boxes[0])){
+                        valid = false;
+                        continue;
+                    }
+                    stress_add_live(revived_points[i]);
+                }
+                tree.Box_Search(boxes[0], result);
+                PointVector ().swap(expected);
+                for (int i = 0; i < stress_live.size(); i++){
+                    if (stress_in_box(stress_live[i], boxes[0])) expected.push_back(stress_live[i]);
+                }
+                stress_checks[CHECK_REVIVE]++;
+                if (!valid || !stress_same_ids(result, expected)) stress_mismatches[CHECK_REVIVE]++;
+            }
+            break;
+        case STRESS_DELETE_REGIONS:
+            {
+                PointType center = stress_random_point(rng);
+                float radius = uniform_real_distribution<float>(0.5, Stress_Box_Length)(rng);
+                vector<RegionType> regions(1, Sphere_Region(center, radius));
+                stress_run(op, [&](){
+                    tree.Delete_Point_Regions(regions);
+                });
+                PointVector ().swap(expected);
+                for (int i = 0; i < stress_live.size(); i++){
+                    if (stress_in_sphere(stress_live[i], center, radius)) expected.push_back(stress_live[i]);
+                }
+                for (int i = 0; i < expected.size(); i++) stress_remove_live(expected[i].id);
+            }
+            break;
+        case STRESS_NEAREST_SEARCH:
+            for (int i = 0; i < Stress_Query_Num; i++){
+                PointType query = stress_random_point(rng);
+                int k_nearest = 1 + rng() % Stress_Max_Nearest_Num;
+                stress_run(op, [&](){
+                    tree.Nearest_Search(query, k_nearest, result, result_dist);
+                });
+                stress_checks[CHECK_NEAREST]++;
+                if (!stress_check_nearest(stress_live, query, k_nearest, result, result_dist)) stress_mismatches[CHECK_NEAREST]++;
+            }
+            break;
+        case STRESS_BOX_SEARCH:
+            {
+                BoxPointType box = stress_random_box(rng);
+                stress_run(op, [&](){
+                    tree.Box_Search(box, result);
+                });
+                PointVector ().swap(expected);
+                for (int i = 0; i < stress_live.size(); i++){
+                    if (stress_in_box(stress_live[i], box)) expected.push_back(stress_live[i]);
+                }
+                stress_checks[CHECK_BOX]++;
+                if (!stress_same_ids(result, expected)) stress_mismatches[CHECK_BOX]++;
+            }
+            break;
+        case STRESS_REGION_SEARCH:
+            {
+                PointType center = stress_random_point(rng);
+                float radius = uniform_real_distribution<float>(0.5, Stress_Box_Length)(rng);
+                RegionType region = Sphere_Region(center, radius);
+                stress_run(op, [&](){
+                    tree.Region_Search(region, result);
+                });
+                PointVector ().swap(expected);
+                for (int i = 0; i < stress_live.size(); i++){
+                    if (stress_in_sphere(stress_live[i], center, radius)) expected.push_back(stress_live[i]);
+                }
+                stress_checks[CHECK_REGION]++;
+                if (!stress_same_ids(result, expected)) stress_mismatches[CHECK_REGION]++;
+            }
+            break;
+        default:
+            break;
+        }
+        stress_checks[CHECK_VALIDNUM]++;
+        if (tree.validnum() != int(stress_live.size())) stress_mismatches[CHECK_VALIDNUM]++;
+        if (iter % Stress_Snapshot_Interval == 0){
+            pthread_mutex_lock(&verifier.mutex);
+            if (!verifier.pending){
+                // Snapshots are released by the writer thread that takes them
+                verifier.snapshot = tree.Snapshot();
+                verifier.reference = stress_live;
+                verifier.seed = rng();
+                verifier.pending = true;
+                verifier.done = false;
+                pthread_cond_signal(&verifier.signal);
+            }
+            pthread_mutex_unlock(&verifier.mutex);
+        }
+    }
+    pthread_mutex_lock(&verifier.mutex);
+    while (verifier.pending) {
+        pthread_mutex_unlock(&verifier.mutex);
+        usleep(1000);
+        pthread_mutex_lock(&verifier.mutex);
+    }
+    verifier.stop = true;
+    pthread_cond_signal(&verifier.signal);
+    pthread_mutex_unlock(&verifier.mutex);
+    pthread_join(verifier_thread, NULL);
+    verifier.snapshot.reset();
+    stress_checks[CHECK_SNAPSHOT] = verifier.checks;
+    stress_mismatches[CHECK_SNAPSHOT] = verifier.mismatches;
+    printf("Stress (%d iterations, seed %u, %d live points, tree size %d):\n", iteration_num, seed, int(stress_live.size()), tree.size());
+    for (int i = 0; i < STRESS_OPERATION_NUM; i++){
+        Stress_Operation_Stats & stats = stress_stats[i];
+        if (stats.calls == 0) continue;
+        printf("    %-24s %8lld calls, %10.3f us/call", stress_operation_names[i], stats.calls, stats.time_us / stats.calls);
+        if (cache_misses.fd >= 0) printf(", %10.1f cache misses/call", double(stats.cache_misses) / stats.calls);
+        if (branch_misses.fd >= 0) printf(", %10.1f branch misses/call", double(stats.branch_misses) / stats.calls);
+        printf("\n");
+    }
+    if (cache_misses.fd < 0 && branch_misses.fd < 0) printf("    perf counters unavailable\n");
+    long long mismatch_num = 0;
+    for (int i = 0; i < CHECK_NUM; i++){
+        printf("    %-10s checks %8lld, mismatches %lld\n", stress_check_names[i], stress_checks[i], stress_mismatches[i]);
+        mismatch_num += stress_mismatches[i];
+    }
+    pthread_mutex_destroy(&verifier.mutex);
+    pthread_cond_destroy(&verifier.signal);
+    return mismatch_num > 0 ? 1 : 0;
+}
+
+/*
+    Re-execute a trace recorded with KD_TREE::Start_Trace, in record order on one thread. With paced,
+    each call waits for its recorded time so that the rebuild thread sees the original timing.
+*/
+
+int benchmark_replay(const char * trace_file, bool paced){
+    const char * operation_names[TRACE_OPERATION_NUM] = {"Build", "Add_Points", "Delete_Points", "Add_Point_Boxes", "Delete_Point_Boxes",
+            "Add_Point_Regions", "Delete_Point_Regions", "Nearest_Search", "Box_Search", "Box_Search_Parallel", "Region_Search"};
+    FILE * fp = fopen(trace_file, "rb");
+    if (fp == nullptr){
+        fprintf(stderr, "Cannot open %s\n", trace_file);
+        return 1;
+    }
+    Trace_Header_Type header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, "IKDR", 4) != 0 || header.version != Trace_Version || header.point_size != sizeof(PointType)){
+        fprintf(stderr, "%s is not a trace of this version\n", trace_file);
+        fclose(fp);
+        return 1;
+    }
+    KD_TREE tree(header.delete_param, header.balance_param, header.box_length);
+    Trace_Record_Type record;
+    PointVector points, result;
+    vector<BoxPointType> boxes;
+    vector<RegionType> regions;
+    vector<float> result_dist;
+    vector<double> latency_us[TRACE_OPERATION_NUM];
+    auto replay_start = chrono::steady_clock::now();
+    bool truncated = false;
+    while (fread(&record, sizeof(record), 1, fp) == 1){
+        size_t read_num = record.count;
+        if (record.op == TRACE_ADD_POINTS || record.op == TRACE_DELETE_POINTS || record.op == TRACE_BUILD || record.op == TRACE_NEAREST_SEARCH){
+            points.resize(record.count);
+            read_num = fread(points.data(), sizeof(PointType), record.count, fp);
+        } else if (record.op == TRACE_ADD_REGIONS || record.op == TRACE_DELETE_REGIONS || record.op == TRACE_REGION_SEARCH){
+            regions.resize(record.count);
+            read_num = fread(regions.data(), sizeof(RegionType), record.count, fp);
+        } else if (record.op < TRACE_OPERATION_NUM){
+            boxes.resize(record.count);
+            read_num = fread(boxes.data(), sizeof(BoxPointType), record.count, fp);
+        }
+        if (record.op >= TRACE_OPERATION_NUM || read_num != record.count){
+            truncated = true;
+            break;
+        }
+        if (paced) this_thread::sleep_until(replay_start + chrono::nanoseconds(record.time_ns));
+        auto t1 = chrono::high_resolution_clock::now();
+        switch (record.op)
+        {
+        case TRACE_BUILD:
+            tree.Build(points);
+            break;
+        case TRACE_ADD_POINTS:
+            tree.Add_Points(points, record.param);
+            break;
+        case TRACE_DELETE_POINTS:
+            tree.Delete_Points(points);
+            break;
+        case TRACE_ADD_BOXES:
+            tree.Add_Point_Boxes(boxes);
+            break;
+        case TRACE_DELETE_BOXES:
+            tree.Delete_Point_Boxes(boxes);
+            break;
+        case TRACE_ADD_REGIONS:
+            tree.Add_Point_Regions(regions);
+            break;
+        case TRACE_DELETE_REGIONS:
+            tree.Delete_Point_Regions(regions);
+            break;
+        case TRACE_NEAREST_SEARCH:
+            tree.Nearest_Search(points[0], record.param, result, result_dist);
+            break;
+        case TRACE_BOX_SEARCH:
+            tree.Box_Search(boxes[0], result);
+            break;
+        case TRACE_BOX_SEARCH_PARALLEL:
+            tree.Box_Search_Parallel(boxes[0], record.param, [](int, const PointType &){});
+            break;
+        case TRACE_REGION_SEARCH:
+            tree.Region_Search(regions[0], result);
+            break;
+        default:
+            break;
+        }
+        auto t2 = chrono::high_resolution_clock::now();
+        latency_us[record.op].push_back(chrono::duration_cast<chrono::nanoseconds>(t2-t1).count() / 1e3);
+    }
+    fclose(fp);
+    auto replay_end = chrono::steady_clock::now();
+    printf("Replay of %s (%s):\n", trace_file, paced ? "paced" : "back to back");
+    for (int i = 0; i < TRACE_OPERATION_NUM; i++){
+        vector<double> & latency = latency_us[i];
+        if (latency.empty()) continue;
+        double total_us = 0.0;
+        for (int j = 0; j < latency.size(); j++) total_us += latency[j];
+        sort(latency.begin(), latency.end());
+        printf("    %-20s %8d calls, mean %10.3f us, p50 %10.3f us, p99 %10.3f us, max %10.3f us, total %0.3f ms\n", operation_names[i], int(latency.size()),
+                total_us / latency.size(), latency_percentile(latency, 0.5), latency_percentile(latency, 0.99), latency.back(), total_us / 1e3);
+    }
+    printf("    Wall time %0.3f ms, tree size %d, valid %d, rebuilt points %d\n", chrono::duration_cast<chrono::microseconds>(replay_end - replay_start).count() / 1e3,
+            tree.size(), tree.validnum(), tree.rebuild_counter);
+#if KD_TREE_STATS
+    print_tree_stats(tree);
+#endif
+    if (truncated) fprintf(stderr, "%s ends with a truncated record\n", trace_file);
+    return 0;
+}
+
+int main(int argc, char** argv){
+    // Usage: ikd_Tree_benchmark [order|prefetch|plane|transform|voxel|async|forest] [map_size] [query_num]
+    //        ikd_Tree_benchmark suite [results.csv|results.json] [quick]
+    //        ikd_Tree_benchmark stress [iterations] [seed] [trace_file]
+    //        ikd_Tree_benchmark replay trace_file [paced]
+    const char * test_name = "order";
+    if (argc > 1) test_name = argv[1];
+    if (strcmp(test_name, "replay") == 0 && argc > 2){
+        return benchmark_replay(argv[2], argc > 3 && strcmp(argv[3], "paced") == 0);
+    }
+    if (strcmp(test_name, "stress") == 0){
+        return benchmark_stress(argc > 2 ? atoi(argv[2]) : Stress_Iteration_Num, argc > 3 ? strtoul(argv[3], nullptr, 10) : Random_Seed, argc > 4 ? argv[4] : nullptr);
+    }
+    if (strcmp(test_name, "suite") == 0){
+        return benchmark_suite(argc > 2 ? argv[2] : "ikd_Tree_benchmark.csv", argc > 3 && strcmp(argv[3], "quick") == 0);
+    }
+    bool test_prefetch = strcmp(test_name, "prefetch") == 0;
+    int map_num = test_prefetch ? Large_Map_Point_Num : Map_Point_Num;
+    int query_num = Query_Num;
+    if (argc > 2) map_num = atoi(argv[2]);
+    if (argc > 3) query_num = atoi(argv[3]);
+    if (strcmp(test_name, "forest") == 0){
+        benchmark_forest(map_num, query_num);
+        return 0;
+    }
+    KD_TREE ikd_Tree(0.3, 0.6, 0.2);
+    generate_map_cloud(map_num);
+    generate_query_cloud(query_num);
+    auto t1 = chrono::high_resolution_clock::now();
+    ikd_Tree.Build(map_cloud);
+    auto t2 = chrono::high_resolution_clock::now();
+    printf("Build %d points: %0.3f ms\n", map_num, chrono::duration_cast<chrono::microseconds>(t2-t1).count()/1e3);
+    if (test_prefetch){
+        benchmark_prefetch(ikd_Tree);
+    } else if (strcmp(test_name, "plane") == 0){
+        benchmark_plane_fit(ikd_Tree);
+    } else if (strcmp(test_name, "transform") == 0){
+        benchmark_transform(ikd_Tree);
+    } else if (strcmp(test_name, "voxel") == 0){
+        benchmark_voxel_cache(ikd_Tree);
+    } else if (strcmp(test_name, "async") == 0){
+        benchmark_async(ikd_Tree);
+    } else {
+        benchmark_query_order(ikd_Tree);
+    }
+#if KD_TREE_STATS
+    print_tree_stats(ikd_Tree);
+#endif
+    return 0;
+}